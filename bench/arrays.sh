@@ -0,0 +1,23 @@
+#!/bin/bash
+# Array reductions vs scalar loops: R dot products of an N element array
+# with itself, once through the dot builtin (a 4-lane vector loop even in
+# strict mode) and once as a for loop over the same values, which strict
+# floating point keeps sequential. Both print the same value up to
+# rounding, since the two sum in different orders.
+#
+#   bench/arrays.sh [N] [R]     TLANG=path/to/tlang to use another binary
+
+N=${1:-1000000}
+R=${2:-200}
+DEFS=$(cat <<TL
+fn half(x) x * 0.5
+fn loopdot(n: int) for i = 0, n half(i) * half(i)
+TL
+)
+. "$(dirname "$0")/common.sh"
+
+echo "Dot products, N = $N, R = $R"
+for O in -O1 -O2; do
+    run "array$O" $O "{ let a = map(half, range($N)); for k = 0, $R dot(a, a) }"
+    run "loop$O" $O "for k = 0, $R loopdot($N)"
+done
@@ -0,0 +1,23 @@
+# Shared by the kernel benchmarks, sourced once each has set its defaults:
+#
+#   . "$(dirname "$0")/common.sh"
+#
+# DEFS holds the definitions every run starts with, WIDTH the width of the
+# name column (default 12). TLANG=path/to/tlang uses another binary.
+#
+# run name flags expression writes DEFS and the expression to a script, runs
+# it with -no-cache -tier-threshold=0 and then the flags (later options win),
+# and prints the wall time and the last result or error, which it also
+# leaves in OUT for scripts that check it.
+
+TLANG=${TLANG:-./tlang}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+run() { # name, flags, expression
+    printf '%s\n%s\n' "$DEFS" "$3" > "$TMP/$1.tl"
+    local start=$(date +%s%N)
+    OUT=$("$TLANG" -no-cache -tier-threshold=0 $2 "$TMP/$1.tl" 2>&1 | grep "Evaluated to\|log_error" | tail -1)
+    local end=$(date +%s%N)
+    printf "%-${WIDTH:-12}s %10.1f ms   %s\n" "$1" "$(( (end - start) / 1000 ))e-3" "${OUT:-no result}"
+}
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Parse and codegen throughput on deep expressions, for comparing two builds
+# of tlang, for example the revisions before and after a parser change:
+# COUNT definitions, each one expression nested DEPTH deep, and a single
+# top-level expression, so nearly all of the time goes to reading and
+# generating code. Each binary runs the script 5 times and the fastest run
+# is reported, with the speedup of the second over the first.
+#
+#   bench/deep.sh OLD NEW [DEPTH] [COUNT]
+#
+# Both binaries only get the script as an argument, so any revision runs.
+# Builds from before the interpreter tier generate code for every definition
+# as it is read; later ones interpret cold definitions, so compare those with
+# TLANG_FLAGS=-tier-threshold=0 where both understand it.
+
+OLD=$1
+NEW=$2
+DEPTH=${3:-200}
+COUNT=${4:-500}
+[ -x "$OLD" ] && [ -x "$NEW" ] || { echo "usage: bench/deep.sh OLD NEW [DEPTH] [COUNT]"; exit 1; }
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for ((k = 0; k < COUNT; k++)); do
+    printf 'fn deep%d(x) ' $k
+    for ((i = 0; i < DEPTH; i++)); do printf '(x * 0.5 + '; done
+    printf '%d' $k
+    for ((i = 0; i < DEPTH; i++)); do printf ')'; done
+    echo
+done > "$TMP/deep.tl"
+echo "deep0(1)" >> "$TMP/deep.tl"
+
+best() { # binary, prints the fastest of 5 runs in ms
+    local min=
+    for r in 1 2 3 4 5; do
+        local start=$(date +%s%N)
+        "$1" $TLANG_FLAGS "$TMP/deep.tl" > /dev/null 2>&1 || { echo "$1 failed" >&2; exit 1; }
+        local ms=$(( ($(date +%s%N) - start) / 1000000 ))
+        [ -z "$min" ] || [ $ms -lt $min ] && min=$ms
+    done
+    echo $min
+}
+
+echo "$COUNT definitions nested $DEPTH deep"
+A=$(best "$OLD") || exit 1
+B=$(best "$NEW") || exit 1
+printf "%-8s %8s ms\n%-8s %8s ms\n" old "$A" new "$B"
+printf "speedup  %8.2fx\n" "$(echo "$A / $B" | bc -l)"
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Strict IEEE vs fn fast on a reduction: the Basel series, sum of 1/i^2 for
+# i = 1..N (pi^2/6 in the limit). Reports the time for each version and how
+# far the fast result drifts from the strict one.
+#
+#   bench/fastmath.sh [N]     TLANG=path/to/tlang to use another binary
+#
+# Both run compiled at -O2. The loop vectorizer may only split the sum into
+# several partial sums when the function is fast.
+
+N=${1:-100000000}
+WIDTH=8
+DEFS=$(cat <<TL
+fn basel(n) for i = 1, n + 1 1 / (i * i)
+fn fast fbasel(n) for i = 1, n + 1 1 / (i * i)
+TL
+)
+. "$(dirname "$0")/common.sh"
+
+echo "Basel series, N = $N"
+run strict -O2 "basel($N)"
+run fast -O2 "fbasel($N)"
+# Printed with 6 decimals, so scale the difference up
+run delta -O2 "(fbasel($N) - basel($N)) * 1000000000000"
+echo "(delta is fast - strict, in units of 1e-12)"
@@ -0,0 +1,21 @@
+#!/bin/bash
+# Integer vs double arithmetic: counts the lattice points inside a circle of
+# radius R, once with an int parameter (native i64 loops, compares and sums)
+# and once untyped, where every value is a double as before there were types.
+# Both should print the same count.
+#
+#   bench/ints.sh [R]     TLANG=path/to/tlang to use another binary
+
+R=${1:-20000}
+DEFS=$(cat <<TL
+fn ipoints(r: int) for x = 0 - r, r + 1 for y = 0 - r, r + 1 x * x + y * y < r * r
+fn dpoints(r) for x = 0 - r, r + 1 for y = 0 - r, r + 1 x * x + y * y < r * r
+TL
+)
+. "$(dirname "$0")/common.sh"
+
+echo "Lattice points, R = $R"
+for O in -O1 -O2; do
+    run "int$O" $O "ipoints($R)"
+    run "double$O" $O "dpoints($R)"
+done
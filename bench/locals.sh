@@ -0,0 +1,30 @@
+#!/bin/bash
+# Locals vs argument passing: the same kernel written with let, and in the
+# style needed before there were variables, where every shared subexpression
+# is passed down as an extra argument to a helper. Both are summed over
+# N calls and should print the same value.
+#
+#   bench/locals.sh [N]     TLANG=path/to/tlang to use another binary
+
+N=${1:-50000000}
+DEFS=$(cat <<TL
+fn withlet(x) {
+    let a = x * x + 1;
+    let b = a * a - x;
+    let c = a * b;
+    c / (a + b) + b / c
+}
+
+fn args3(x a b c) c / (a + b) + b / c
+fn args2(x a b) args3(x, a, b, a * b)
+fn args1(x a) args2(x, a, a * a - x)
+fn withargs(x) args1(x, x * x + 1)
+TL
+)
+. "$(dirname "$0")/common.sh"
+
+echo "Locals vs arguments, N = $N"
+for O in -O1 -O2; do
+    run "let$O" $O "for i = 0, $N withlet(i)"
+    run "args$O" $O "for i = 0, $N withargs(i)"
+done
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Imported math functions: sums sqrt(i) and sin(i) over N terms. The imports
+# are called through LLVM intrinsics, so the sqrt loop vectorizes in a fast
+# function with sqrtpd; the sin loop only vectorizes once -veclib=libmvec
+# supplies vector variants. Each kernel runs with and without the vector
+# library, and the pairs should print the same value up to the last bits.
+#
+#   bench/mathlib.sh [N]     TLANG=path/to/tlang to use another binary
+
+N=${1:-100000000}
+WIDTH=16
+DEFS=$(cat <<TL
+import sqrt(x)
+import sin(x)
+fn fast sqrts(n: int) for i = 0, n sqrt(i)
+fn fast sines(n: int) for i = 0, n sin(i)
+TL
+)
+. "$(dirname "$0")/common.sh"
+
+echo "Math imports, N = $N"
+for V in none libmvec; do
+    run "sqrt-$V" "-O2 -veclib=$V" "sqrts($N)"
+    run "sin-$V" "-O2 -veclib=$V" "sines($N)"
+done
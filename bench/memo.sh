@@ -0,0 +1,20 @@
+#!/bin/bash
+# Memoized vs plain recursion: naive fib, once as written and once with the
+# memo annotation. The plain one is exponential, so keep N modest. Both should
+# print the same values.
+#
+#   bench/memo.sh [N]       TLANG=path/to/tlang to use another binary
+
+N=${1:-32}
+DEFS=$(cat <<TL
+fn fib(n: int): int if n < 2 n else fib(n - 1) + fib(n - 2)
+fn memo mfib(n: int): int if n < 2 n else mfib(n - 1) + mfib(n - 2)
+TL
+)
+. "$(dirname "$0")/common.sh"
+
+echo "Memoized fib, N = $N"
+for O in -O1 -O2; do
+    run "plain$O" $O "fib($N)"
+    run "memo$O" $O "mfib($N)"
+done
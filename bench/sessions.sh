@@ -0,0 +1,113 @@
+#!/bin/bash
+# Concurrent sessions: 1, 2, 4, ... threads, each with its own libtlang
+# session, compile the same generated modules in a loop and call every
+# function once to check its result, every other round from a thread that did
+# not compile it. Halfway through each thread closes its session and opens a
+# new one. Prints the functions compiled per second for each thread count and
+# the speedup over one thread, which should stay close to the thread count up
+# to the number of cores. A wrong result or a failed compile stops the run.
+#
+#   bench/sessions.sh [ROUNDS] [THREADS...]
+#   LIBTLANG=path/to/libtlang.so to use another build, FLAGS for session options
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+LIBTLANG=${LIBTLANG:-./libtlang.so}
+FLAGS=${FLAGS:--O1}
+ROUNDS=${1:-20}
+shift
+THREADS=${@:-1 2 4 8}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/sessions.cpp" <<'CPP'
+#include "libtlang.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int FUNCTIONS = 50; // Per module
+static int Rounds;
+static std::vector<const char *> Flags;
+
+// fn f<k>(x, n: int) sums x * i + k for i < n, and calls f<k-1> so every
+// module links against itself
+static std::string module_source() {
+    std::string S = "fn f0(x, n: int) for i = 0, n x * i\n";
+    for (int k = 1; k < FUNCTIONS; k++)
+        S += "fn f" + std::to_string(k) + "(x, n: int) f" + std::to_string(k - 1) + "(x, n) + for i = 0, n " +
+             std::to_string(k) + "\n";
+    return S;
+}
+
+// Calls every function of M once, false at the first wrong result
+static bool check_module(tlang_module *M) {
+    for (int k = 0; k != FUNCTIONS; k++) {
+        auto f = (double (*)(double, int64_t))tlang_address(tlang_lookup(M, ("f" + std::to_string(k)).c_str()));
+        double Want = 1.5 * 10 * 9 / 2 + 10.0 * k * (k + 1) / 2;
+        if (f(1.5, 10) != Want) {
+            fprintf(stderr, "f%d(1.5, 10) = %f, expected %f\n", k, f(1.5, 10), Want);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_session(const std::string &Source, int Rounds) {
+    tlang_session *S = tlang_open(Flags.size(), Flags.data());
+    if (!S) return false;
+    for (int r = 0; r != Rounds; r++) {
+        tlang_module *M = tlang_compile(S, Source.c_str(), Source.size());
+        if (!M) {
+            fprintf(stderr, "compile failed: %s\n", tlang_error(S));
+            return false;
+        }
+        bool OK = false;
+        if (r % 2)
+            std::thread([&] { OK = check_module(M); }).join();
+        else
+            OK = check_module(M);
+        if (!OK) return false;
+        tlang_unload(S, M);
+    }
+    tlang_close(S);
+    return true;
+}
+
+static void run_thread(const std::string *Source, bool *OK) {
+    *OK = run_session(*Source, Rounds / 2) && run_session(*Source, Rounds - Rounds / 2);
+}
+
+int main(int argc, char **argv) {
+    Rounds = atoi(argv[1]);
+    int Threads = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) Flags.push_back(argv[i]);
+    std::string Source = module_source();
+
+    std::vector<std::thread> Pool;
+    std::unique_ptr<bool[]> OK(new bool[Threads]());
+    auto Start = std::chrono::steady_clock::now();
+    for (int t = 0; t != Threads; t++) Pool.emplace_back(run_thread, &Source, &OK[t]);
+    for (auto &T : Pool) T.join();
+    double Secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    for (int t = 0; t != Threads; t++)
+        if (!OK[t]) return 1;
+    printf("%.1f\n", (double)Threads * Rounds * FUNCTIONS / Secs);
+    return 0;
+}
+CPP
+
+${CXX:-c++} -std=c++11 -O2 -pthread -I"$DIR/src" "$TMP/sessions.cpp" "$LIBTLANG" -Wl,-rpath,"$(dirname "$(realpath "$LIBTLANG")")" \
+    -o "$TMP/sessions" || exit 1
+
+echo "Concurrent sessions, $ROUNDS rounds of 50 functions per thread, $(nproc) cores"
+printf "%-8s %14s %9s\n" threads "functions/s" speedup
+BASE=
+for T in $THREADS; do
+    RATE=$("$TMP/sessions" "$ROUNDS" "$T" $FLAGS) || { echo "failed with $T threads"; exit 1; }
+    BASE=${BASE:-$RATE}
+    printf "%-8s %14s %8.2fx\n" "$T" "$RATE" "$(echo "$RATE / $BASE" | bc -l)"
+done
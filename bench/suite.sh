@@ -0,0 +1,62 @@
+#!/bin/bash
+# Stage benchmark: runs a generated corpus (one deep expression, many small
+# definitions, recursive numeric code and a long script of top-level
+# expressions) with -time-json and collects how long each program spent
+# lexing, parsing, checking, generating IR, optimizing, compiling in the JIT
+# and executing. Prints one JSON document, so runs on the same machine can be
+# compared across versions.
+#
+#   bench/suite.sh [SCALE] > results.json
+#   TLANG=path/to/tlang to use another binary, FLAGS to add options
+#   (default -tier-threshold=0, so every definition goes through the JIT)
+
+TLANG=${TLANG:-./tlang}
+SCALE=${1:-1}
+FLAGS=${FLAGS:--tier-threshold=0}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Nesting depth 200 * SCALE, kept out of the folder's reach by the parameter
+{
+    printf 'fn deep(x) '
+    for ((i = 0; i < 200 * SCALE; i++)); do printf '(x * 0.5 + '; done
+    printf '1'
+    for ((i = 0; i < 200 * SCALE; i++)); do printf ')'; done
+    printf '\nfor i = 0, 100000 deep(i)\n'
+} > "$TMP/deep.tl"
+
+# 2000 * SCALE definitions, each calling the one before
+{
+    echo 'fn f0(x) x + 1'
+    for ((i = 1; i < 2000 * SCALE; i++)); do echo "fn f$i(x) f$((i - 1))(x) * 0.5 + $i"; done
+    echo "f$((2000 * SCALE - 1))(1)"
+} > "$TMP/defs.tl"
+
+cat > "$TMP/recursion.tl" <<TL
+fn fib(n: int): int if n < 2 n else fib(n - 1) + fib(n - 2)
+fn tak(x: int, y: int, z: int): int if y < x tak(tak(x - 1, y, z), tak(y - 1, z, x), tak(z - 1, x, y)) else z
+fn ack(m: int, n: int): int if m = 0 n + 1 else if n = 0 ack(m - 1, 1) else ack(m - 1, ack(m, n - 1))
+fib($((24 + SCALE)))
+tak(18, 12, 6)
+ack(3, $((5 + SCALE)))
+TL
+
+# 20000 * SCALE top-level expressions over a few definitions
+{
+    echo 'fn poly(x) x * x * 3 - x * 2 + 1'
+    echo 'fn mix(a b) if a < b poly(a) else poly(b)'
+    for ((i = 0; i < 20000 * SCALE; i++)); do echo "mix($i, $((i % 97))) + poly($i)"; done
+} > "$TMP/script.tl"
+
+echo "{\"tlang\": \"$(git describe --always --dirty 2>/dev/null || echo unknown)\", \"flags\": \"$FLAGS\", \"scale\": $SCALE, \"results\": ["
+Sep=""
+for Name in deep defs recursion script; do
+    for O in -O0 -O1 -O2; do
+        rm -f "$TMP/out.json"
+        "$TLANG" -no-cache $O $FLAGS -time-json="$TMP/out.json" "$TMP/$Name.tl" > /dev/null 2>&1
+        [ -s "$TMP/out.json" ] || continue
+        printf '%s  {"program": "%s", "opt": "%s", "run": %s}' "$Sep" "$Name" "$O" "$(cat "$TMP/out.json")"
+        Sep=$',\n'
+    done
+done
+printf '\n]}\n'
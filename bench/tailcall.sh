@@ -0,0 +1,24 @@
+#!/bin/bash
+# Tail recursion N deep (10^8 by default), which only finishes if the
+# recursion runs in constant stack. Runs with the JIT at -O0 (no passes,
+# so it relies on codegen alone), at -O2, and through the tiered
+# interpreter. Each run must print N; the script exits with 1 if one does
+# not (a stack overflow prints nothing).
+#
+#   bench/tailcall.sh [N]     TLANG=path/to/tlang to use another binary
+
+N=${1:-100000000}
+WIDTH=8
+DEFS='fn count(n acc) if n = 0 acc else if n < 0 0 else count(n - 1, acc + 1)'
+. "$(dirname "$0")/common.sh"
+
+echo "Tail recursion, N = $N"
+FAILED=0
+check() { # name, flags
+    run "$1" "$2" "count($N, 0)"
+    [ "$OUT" = "Evaluated to $N.000000" ] || { echo "$1: expected $N"; FAILED=1; }
+}
+check O0 -O0
+check O2 -O2
+check tiered "-O2 -tier-threshold=1000"
+exit $FAILED
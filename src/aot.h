@@ -0,0 +1,204 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "tlang.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+
+// --- Ahead-of-time compilation ---
+// tlangc file.tl -o kernels.o (tlang -c ..., or any binary named tlangc)
+// reads a script like the JIT would: every definition goes through
+// FnExpression::codegen() and the same per-function passes as it is read,
+// into one module, which then gets the module passes, multiversioning
+// included, and is written as a position independent object. An output
+// ending in .so is linked into a shared library with the system's cc.
+// Top-level expressions and bench have nothing to run on and are skipped.
+//
+// Next to the output goes a C header (kernels.h) declaring every
+// definition: double, int as int64_t, bool and array as tlang_array *. It
+// also declares the imports the object expects the host to provide (libm
+// intrinsics excepted). Memo tables become globals of the object. Arrays
+// made by map and range come from a small runtime that the header carries:
+// one file of the host defines TLANG_IMPLEMENTATION before including it, and
+// calls tlangc_release_arrays() once it is done with those arrays, as the
+// REPL does after each top-level expression. Nothing else is needed at run
+// time, LLVM included. Headers of several objects, and libtlang.h, can be
+// included together: they share tlang_array and the runtime.
+
+static bool AotMode = false;   // tlangc, or -c
+static std::string AotOutput;  // -o
+
+// HELPER FUNCTION -- the JIT's target, position independent
+static std::unique_ptr<llvm::TargetMachine> aot_target_machine(const llvm::TargetMachine &JITTM) {
+    std::string Err;
+    const llvm::Triple &TT = JITTM.getTargetTriple();
+    const llvm::Target *T = llvm::TargetRegistry::lookupTarget(TT.str(), Err);
+    if (!T) {
+        fprintf(stderr, "tlangc: %s\n", Err.c_str());
+        return nullptr;
+    }
+    return std::unique_ptr<llvm::TargetMachine>(
+        T->createTargetMachine(TT.str(), JITTM.getTargetCPU(), JITTM.getTargetFeatureString(), JITTM.Options,
+                               llvm::Reloc::PIC_, llvm::CodeModel::Default, JITTM.getOptLevel()));
+}
+
+static bool emit_object(llvm::Module &M, llvm::TargetMachine &TM, const std::string &Path) {
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::F_None);
+    if (EC) {
+        fprintf(stderr, "tlangc: cannot write %s: %s\n", Path.c_str(), EC.message().c_str());
+        return false;
+    }
+    llvm::legacy::PassManager PM;
+    if (TM.addPassesToEmitFile(PM, Out, llvm::TargetMachine::CGFT_ObjectFile)) {
+        fprintf(stderr, "tlangc: the target cannot emit objects\n");
+        return false;
+    }
+    PM.run(M);
+    return true;
+}
+
+static bool link_shared(const std::string &Object, const std::string &Path) {
+    auto CC = llvm::sys::findProgramByName("cc");
+    if (!CC) {
+        fprintf(stderr, "tlangc: no cc to link %s with\n", Path.c_str());
+        return false;
+    }
+    const char *Args[] = {"cc", "-shared", "-o", Path.c_str(), Object.c_str(), "-lm", nullptr};
+    std::string Err;
+    if (llvm::sys::ExecuteAndWait(*CC, Args, nullptr, nullptr, 0, 0, &Err) != 0) {
+        fprintf(stderr, "tlangc: linking %s failed %s\n", Path.c_str(), Err.c_str());
+        return false;
+    }
+    return true;
+}
+
+static const char *c_type(ValueType T) {
+    switch (T) {
+        case T_BOOL: return "bool";
+        case T_INT: return "int64_t";
+        case T_ARRAY: return "tlang_array *";
+        default: return "double";
+    }
+}
+
+static std::string c_prototype(const ProtoFn &P) {
+    std::string S = std::string(c_type(P.getReturnType())) + " " + SYMBOLS.name(P.getName()).str() + "(";
+    for (unsigned i = 0; i != P.getArgs().size(); i++)
+        S += std::string(i ? ", " : "") + c_type(P.getArgTypes()[i]) + " " + SYMBOLS.name(P.getArgs()[i]).str();
+    return S + (P.getArgs().empty() ? "void);" : ");");
+}
+
+static const char AOT_RUNTIME[] = R"(
+#if defined(TLANG_IMPLEMENTATION) && !defined(TLANG_RUNTIME_DEFINED) /* Once for all headers */
+#define TLANG_RUNTIME_DEFINED
+/* Generated code passes its address to the calls below, which have only the
+ * one state to use */
+char __tlang_runtime;
+
+static tlang_array **tlang_temporaries;
+static size_t tlang_count, tlang_capacity;
+
+tlang_array *__tlang_array_new(void *runtime, int64_t len) {
+    tlang_array *a = NULL;
+    if ((uint64_t)len <= (SIZE_MAX - sizeof(tlang_array)) / sizeof(double))
+        a = (tlang_array *)malloc(sizeof(tlang_array) + len * sizeof(double));
+    if (!a) {
+        fprintf(stderr, "tlang: cannot allocate an array of length %lld\n", (long long)len);
+        exit(1);
+    }
+    a->data = (double *)(a + 1);
+    a->len = len;
+    if (tlang_count == tlang_capacity) {
+        tlang_capacity = tlang_capacity ? 2 * tlang_capacity : 64;
+        tlang_temporaries = (tlang_array **)realloc(tlang_temporaries, tlang_capacity * sizeof(tlang_array *));
+    }
+    tlang_temporaries[tlang_count++] = a;
+    return a;
+}
+
+void __tlang_bounds_error(void *runtime, int64_t index, int64_t len) {
+    fprintf(stderr, "tlang: array index %lld out of bounds for length %lld\n", (long long)index, (long long)len);
+    exit(1);
+}
+
+void __tlang_length_error(void *runtime, int64_t len_a, int64_t len_b) {
+    fprintf(stderr, "tlang: dot of arrays of lengths %lld and %lld\n", (long long)len_a, (long long)len_b);
+    exit(1);
+}
+
+void tlangc_release_arrays(void) {
+    for (size_t i = 0; i != tlang_count; i++) free(tlang_temporaries[i]);
+    tlang_count = 0;
+}
+#endif
+)";
+
+static bool write_header(llvm::Module &M, const std::string &Path, llvm::StringRef Source) {
+    std::string Exports, Imports;
+    for (auto &F : M) {
+        if (F.hasLocalLinkage() || F.getName().startswith("__")) continue;
+        auto &P = symbol_slot(function_protos, SYMBOLS.intern(F.getName()));
+        if (!P) continue;
+        if (!F.isDeclaration()) Exports += c_prototype(*P) + "\n";
+        else if (!P->getIntrinsic()) Imports += c_prototype(*P) + "\n";
+    }
+
+    std::string Guard = "TLANG_" + llvm::sys::path::stem(Path).upper() + "_H";
+    for (char &C : Guard)
+        if (!isalnum((unsigned char)C)) C = '_';
+    std::error_code EC;
+    llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::F_Text);
+    if (EC) {
+        fprintf(stderr, "tlangc: cannot write %s: %s\n", Path.c_str(), EC.message().c_str());
+        return false;
+    }
+    Out << "/* Generated by tlangc from " << llvm::sys::path::filename(Source) << ", do not edit. */\n"
+        << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+        << "#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n"
+        << "#ifdef TLANG_IMPLEMENTATION\n#include <stdio.h>\n#include <stdlib.h>\n#endif\n\n"
+        << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n"
+        << "/* An array, with its elements read in place. Shared with other tlangc\n"
+        << " * headers and libtlang.h. */\n"
+        << "#ifndef TLANG_ARRAY_DEFINED\n#define TLANG_ARRAY_DEFINED\n"
+        << "typedef struct tlang_array {\n    double *data;\n    int64_t len;\n} tlang_array;\n#endif\n\n"
+        << Exports;
+    if (!Imports.empty()) Out << "\n/* Provided by the host */\n" << Imports;
+    Out << "\n/* Frees the arrays map and range have made so far */\nvoid tlangc_release_arrays(void);\n"
+        << AOT_RUNTIME
+        << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+    return true;
+}
+
+// Writes MODULE, all the definitions read, to AotOutput and its header
+static bool compile_aot(const char *Script) {
+    llvm::Module &M = *MODULE;
+    multiversion_module(M);
+    optimize_module(M);
+
+    auto TM = aot_target_machine(jit->getTargetMachine());
+    if (!TM) return false;
+    bool Shared = llvm::sys::path::extension(AotOutput) == ".so";
+    std::string Object = AotOutput;
+    if (Shared) {
+        llvm::SmallString<128> Tmp;
+        if (llvm::sys::fs::createTemporaryFile("tlangc", "o", Tmp)) {
+            fprintf(stderr, "tlangc: cannot create a temporary object\n");
+            return false;
+        }
+        Object = Tmp.str();
+    }
+    bool OK = emit_object(M, *TM, Object) && (!Shared || link_shared(Object, AotOutput));
+    if (Shared) llvm::sys::fs::remove(Object);
+
+    llvm::SmallString<128> Header(AotOutput);
+    llvm::sys::path::replace_extension(Header, "h");
+    return OK && write_header(M, Header.str(), Script);
+}
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include "tlang.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include <mutex>
+
+// --- Arrays ---
+// An array value is a pointer to a struct Array: a length and contiguous
+// doubles. Programs cannot write to arrays, so one the host hands in (as the
+// result of an import, or an argument to one) is read where it lies.
+//
+// Arrays made by map and range are allocated by the runtime below and live
+// until the top-level expression that made them has been evaluated; nothing
+// can hold on to one past that point.
+//
+// The builtins are ordinary calls to names no definition has taken:
+//   len(a)      length, an int
+//   sum(a)      sum of the elements
+//   dot(a, b)   sum of the products, a and b of the same length
+//   min(a)      smallest element (+inf when empty), NaNs ignored
+//   max(a)      largest element (-inf when empty), NaNs ignored
+//   map(f, a)   new array of f(x) for every x of a; f is a function of one double
+//   range(n)    new array 0, 1, ..., n - 1
+// The reductions are emitted as 4-lane vector loops plus a scalar loop for the
+// last len % 4 elements, and the lanes are combined in a fixed order. That
+// order is part of their meaning, so they vectorize without fast math and the
+// interpreter, which follows it too, gets the same bits. a[i] is checked
+// against the length with a single unsigned compare; map, range and the
+// reductions never index out of bounds and carry no checks.
+
+enum Builtin : char { B_LEN, B_SUM, B_DOT, B_MIN, B_MAX, B_MAP, B_RANGE };
+
+static const struct {
+    const char *Name;
+    unsigned Arity;
+} BUILTINS[] = {
+    {"len", 1}, {"sum", 1}, {"dot", 2}, {"min", 1}, {"max", 1}, {"map", 2}, {"range", 1}
+};
+
+// -1 when Name is not a builtin
+static int builtin_id(llvm::StringRef Name) {
+    for (unsigned i = 0; i != sizeof(BUILTINS) / sizeof(BUILTINS[0]); i++)
+        if (Name == BUILTINS[i].Name) return i;
+    return -1;
+}
+
+static const unsigned LANES = 4;
+
+
+
+//                 //
+// --- Runtime --- //
+//                 //
+
+// Called by generated code and the interpreter alike. Its state belongs to
+// a session, not a thread: generated code passes the address of
+// __tlang_runtime, which each JIT resolves to its session's Runtime
+// (start_jit), so code run on any thread reports to the session that
+// compiled it. The interpreter uses the current thread's session's.
+
+static void print_and_exit(const char *Message, void *) {
+    fprintf(stderr, "%s\n", Message);
+    exit(1);
+}
+
+struct Runtime {
+    std::mutex Lock;                  // Calls on several threads make arrays at once
+    std::vector<Array *> Temporaries; // Made while the current top-level expression runs
+    // Where runtime errors go: the REPL prints them and exits, libtlang hands
+    // them to the host. Compiled code has nothing after the call, so if the
+    // handler returns the process aborts.
+    void (*Error)(const char *Message, void *User) = print_and_exit;
+    void *User = nullptr;
+};
+
+static thread_local std::unique_ptr<Runtime> RUNTIME; // This thread's session's
+
+static void array_alloc_error(Runtime *R, int64_t Len) {
+    char Msg[96];
+    snprintf(Msg, sizeof(Msg), "tlang: cannot allocate an array of length %lld", (long long)Len);
+    R->Error(Msg, R->User);
+    abort();
+}
+
+static Array *array_new(Runtime *R, int64_t Len) {
+    if ((uint64_t)Len > (SIZE_MAX - sizeof(Array)) / sizeof(double)) array_alloc_error(R, Len);
+    Array *A = (Array *)malloc(sizeof(Array) + Len * sizeof(double)); // Elements follow the header
+    if (!A) array_alloc_error(R, Len);
+    A->Data = (double *)(A + 1);
+    A->Len = Len;
+    std::lock_guard<std::mutex> Guard(R->Lock);
+    R->Temporaries.push_back(A);
+    return A;
+}
+
+static void array_bounds_error(Runtime *R, int64_t Index, int64_t Len) {
+    char Msg[96];
+    snprintf(Msg, sizeof(Msg), "tlang: array index %lld out of bounds for length %lld", (long long)Index,
+             (long long)Len);
+    R->Error(Msg, R->User);
+    abort();
+}
+
+static void array_length_error(Runtime *R, int64_t LenA, int64_t LenB) {
+    char Msg[96];
+    snprintf(Msg, sizeof(Msg), "tlang: dot of arrays of lengths %lld and %lld", (long long)LenA, (long long)LenB);
+    R->Error(Msg, R->User);
+    abort();
+}
+
+static void release_arrays(Runtime &R) {
+    std::lock_guard<std::mutex> Guard(R.Lock);
+    for (Array *A : R.Temporaries) free(A);
+    R.Temporaries.clear();
+}
+
+// After each top-level expression
+static void release_arrays() { release_arrays(*RUNTIME); }
+
+// Makes the runtime visible to the JIT's symbol lookup
+static void register_array_runtime() {
+    llvm::sys::DynamicLibrary::AddSymbol("__tlang_array_new", (void *)&array_new);
+    llvm::sys::DynamicLibrary::AddSymbol("__tlang_bounds_error", (void *)&array_bounds_error);
+    llvm::sys::DynamicLibrary::AddSymbol("__tlang_length_error", (void *)&array_length_error);
+}
+
+static double reduce_init(char B) {
+    if (B == B_MIN) return INFINITY;
+    if (B == B_MAX) return -INFINITY;
+    return 0.0;
+}
+
+static double reduce_step(char B, double Acc, double X) {
+    if (B == B_MIN) return fmin(Acc, X);
+    if (B == B_MAX) return fmax(Acc, X);
+    return Acc + X;
+}
+
+// sum, dot, min and max, combining in the same order as codegen_reduce
+static double reduce_array(char B, const Array *X, const Array *Y) {
+    if (B == B_DOT && X->Len != Y->Len) array_length_error(RUNTIME.get(), X->Len, Y->Len);
+    auto Elem = [&](int64_t i) { return B == B_DOT ? X->Data[i] * Y->Data[i] : X->Data[i]; };
+
+    int64_t VecEnd = X->Len & ~(int64_t)(LANES - 1);
+    double Lane[LANES];
+    for (double &L : Lane) L = reduce_init(B);
+    for (int64_t i = 0; i < VecEnd; i += LANES)
+        for (unsigned j = 0; j != LANES; j++) Lane[j] = reduce_step(B, Lane[j], Elem(i + j));
+    double R = reduce_step(B, reduce_step(B, Lane[0], Lane[1]), reduce_step(B, Lane[2], Lane[3]));
+    for (int64_t i = VecEnd; i < X->Len; i++) R = reduce_step(B, R, Elem(i));
+    return R;
+}
+
+
+
+//                    //
+// --- Generation --- //
+//                    //
+
+// HELPER FUNCTION -- declares a runtime entry point in the current module
+static llvm::Function *runtime_function(const char *Name, llvm::Type *Ret, llvm::ArrayRef<llvm::Type *> Params,
+                                        bool Error) {
+    llvm::Module *M = BUILDER.GetInsertBlock()->getModule();
+    if (llvm::Function *F = M->getFunction(Name)) return F;
+    llvm::Function *F = llvm::Function::Create(llvm::FunctionType::get(Ret, Params, false),
+                                               llvm::Function::ExternalLinkage, Name, M);
+    if (Error) {
+        F->setDoesNotReturn();
+        F->setDoesNotThrow();
+        F->addFnAttr(llvm::Attribute::Cold);
+    }
+    return F;
+}
+
+// HELPER FUNCTION -- __tlang_runtime, the session's Runtime that every runtime
+// call takes first. Only its address is used, so its type does not matter.
+static llvm::Value *runtime_state() {
+    llvm::Module *M = BUILDER.GetInsertBlock()->getModule();
+    if (llvm::GlobalVariable *G = M->getNamedGlobal("__tlang_runtime")) return G;
+    return new llvm::GlobalVariable(*M, llvm::Type::getInt8Ty(CONTEXT), false, llvm::GlobalValue::ExternalLinkage,
+                                    nullptr, "__tlang_runtime");
+}
+
+// A new array of Len elements from the runtime
+static llvm::Value *emit_array_new(llvm::Value *Len, const char *Name) {
+    llvm::Type *Params[] = {llvm::Type::getInt8PtrTy(CONTEXT), llvm::Type::getInt64Ty(CONTEXT)};
+    return BUILDER.CreateCall(runtime_function("__tlang_array_new", llvm_type(T_ARRAY), Params, false),
+                              {runtime_state(), Len}, Name);
+}
+
+static llvm::Value *array_len(llvm::Value *A) {
+    return BUILDER.CreateLoad(BUILDER.CreateStructGEP(array_struct(), A, 1), "LEN");
+}
+
+static llvm::Value *array_data(llvm::Value *A) {
+    return BUILDER.CreateLoad(BUILDER.CreateStructGEP(array_struct(), A, 0), "DATA");
+}
+
+// Elements are only 8 byte aligned, host arrays included
+static llvm::Value *load_elements(llvm::Value *Data, llvm::Value *I, llvm::Type *Ty) {
+    llvm::Value *Ptr = BUILDER.CreateInBoundsGEP(Data, I);
+    if (Ty->isVectorTy()) Ptr = BUILDER.CreateBitCast(Ptr, Ty->getPointerTo());
+    return BUILDER.CreateAlignedLoad(Ptr, 8, "ELEM");
+}
+
+// Branches to a cold block calling the runtime error Name(A, B) unless OK
+static void emit_check(llvm::Value *OK, const char *Name, llvm::Value *A, llvm::Value *B) {
+    llvm::Function *function = BUILDER.GetInsertBlock()->getParent();
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    llvm::Type *Ptr = llvm::Type::getInt8PtrTy(CONTEXT);
+    llvm::BasicBlock *okblock = llvm::BasicBlock::Create(CONTEXT, "CHECKED", function);
+    llvm::BasicBlock *failblock = llvm::BasicBlock::Create(CONTEXT, "CHECKFAIL", function);
+    BUILDER.CreateCondBr(OK, okblock, failblock, llvm::MDBuilder(CONTEXT).createBranchWeights(1 << 20, 1));
+
+    BUILDER.SetInsertPoint(failblock);
+    BUILDER.CreateCall(runtime_function(Name, llvm::Type::getVoidTy(CONTEXT), {Ptr, I64, I64}, true),
+                       {runtime_state(), A, B});
+    BUILDER.CreateUnreachable();
+    BUILDER.SetInsertPoint(okblock);
+}
+
+// Emits Body(i) for i = 0 .. Len - 1 and continues after the loop
+template <typename BodyFn>
+static void emit_index_loop(llvm::Value *Len, BodyFn Body) {
+    llvm::Function *function = BUILDER.GetInsertBlock()->getParent();
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    llvm::BasicBlock *preheader = BUILDER.GetInsertBlock();
+    llvm::BasicBlock *loopblock = llvm::BasicBlock::Create(CONTEXT, "ALOOP", function);
+    llvm::BasicBlock *afterblock = llvm::BasicBlock::Create(CONTEXT, "ALOOPEND");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSGT(Len, llvm::ConstantInt::get(I64, 0)), loopblock, afterblock);
+
+    BUILDER.SetInsertPoint(loopblock);
+    llvm::PHINode *I = BUILDER.CreatePHI(I64, 2, "I");
+    I->addIncoming(llvm::ConstantInt::get(I64, 0), preheader);
+    Body(I);
+    llvm::Value *NextI = BUILDER.CreateNSWAdd(I, llvm::ConstantInt::get(I64, 1), "NEXTI");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSLT(NextI, Len), loopblock, afterblock);
+    I->addIncoming(NextI, BUILDER.GetInsertBlock());
+
+    function->getBasicBlockList().push_back(afterblock);
+    BUILDER.SetInsertPoint(afterblock);
+    FunctionHasLoops = true;
+}
+
+static llvm::Value *codegen_index(const ExprNode &N) {
+    llvm::Value *A = codegen_expr(N.A);
+    llvm::Value *I = codegen_as(N.B, T_INT);
+    if (!A || !I) return nullptr;
+    llvm::Value *Len = array_len(A);
+    // Negative indexes wrap around to huge ones, so one compare covers both ends
+    emit_check(BUILDER.CreateICmpULT(I, Len, "INBOUNDS"), "__tlang_bounds_error", I, Len);
+    return load_elements(array_data(A), I, llvm::Type::getDoubleTy(CONTEXT));
+}
+
+// sum, dot, min and max, see reduce_array
+static llvm::Value *codegen_reduce(char B, llvm::ArrayRef<ExprRef> Args) {
+    llvm::Value *X = codegen_expr(Args[0]);
+    if (!X) return nullptr;
+    llvm::Value *Y = nullptr;
+    if (B == B_DOT && !(Y = codegen_expr(Args[1]))) return nullptr;
+
+    llvm::Function *function = BUILDER.GetInsertBlock()->getParent();
+    llvm::Type *Double = llvm::Type::getDoubleTy(CONTEXT);
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    llvm::Type *Vec = llvm::VectorType::get(Double, LANES);
+
+    llvm::Value *Len = array_len(X);
+    llvm::Value *XData = array_data(X);
+    llvm::Value *YData = nullptr;
+    if (B == B_DOT) {
+        llvm::Value *YLen = array_len(Y);
+        emit_check(BUILDER.CreateICmpEQ(Len, YLen), "__tlang_length_error", Len, YLen);
+        YData = array_data(Y);
+    }
+
+    auto Elem = [&](llvm::Value *I, llvm::Type *Ty) {
+        llvm::Value *V = load_elements(XData, I, Ty);
+        return B == B_DOT ? BUILDER.CreateFMul(V, load_elements(YData, I, Ty), "PROD") : V;
+    };
+    auto Step = [&](llvm::Value *Acc, llvm::Value *V) -> llvm::Value * {
+        if (B != B_MIN && B != B_MAX) return BUILDER.CreateFAdd(Acc, V, "ACC");
+        llvm::Function *F = llvm::Intrinsic::getDeclaration(
+            function->getParent(), B == B_MIN ? llvm::Intrinsic::minnum : llvm::Intrinsic::maxnum, {V->getType()});
+        return BUILDER.CreateCall(F, {Acc, V}, "ACC");
+    };
+
+    llvm::Value *Init = llvm::ConstantFP::get(Double, reduce_init(B));
+    llvm::Value *VecInit = llvm::ConstantVector::getSplat(LANES, llvm::cast<llvm::Constant>(Init));
+    llvm::Value *VecEnd = BUILDER.CreateAnd(Len, llvm::ConstantInt::get(I64, ~(uint64_t)(LANES - 1)), "VECEND");
+
+    llvm::BasicBlock *preheader = BUILDER.GetInsertBlock();
+    llvm::BasicBlock *vecblock = llvm::BasicBlock::Create(CONTEXT, "VLOOP", function);
+    llvm::BasicBlock *vecdone = llvm::BasicBlock::Create(CONTEXT, "VLOOPEND", function);
+    llvm::BasicBlock *tailblock = llvm::BasicBlock::Create(CONTEXT, "TAIL", function);
+    llvm::BasicBlock *afterblock = llvm::BasicBlock::Create(CONTEXT, "REDUCED", function);
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSGT(VecEnd, llvm::ConstantInt::get(I64, 0)), vecblock, vecdone);
+
+    // LANES elements at a time, one accumulator per lane
+    BUILDER.SetInsertPoint(vecblock);
+    llvm::PHINode *I = BUILDER.CreatePHI(I64, 2, "I");
+    llvm::PHINode *VecAcc = BUILDER.CreatePHI(Vec, 2, "VACC");
+    I->addIncoming(llvm::ConstantInt::get(I64, 0), preheader);
+    VecAcc->addIncoming(VecInit, preheader);
+    llvm::Value *NextAcc = Step(VecAcc, Elem(I, Vec));
+    llvm::Value *NextI = BUILDER.CreateNSWAdd(I, llvm::ConstantInt::get(I64, LANES), "NEXTI");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSLT(NextI, VecEnd), vecblock, vecdone);
+    I->addIncoming(NextI, vecblock);
+    VecAcc->addIncoming(NextAcc, vecblock);
+
+    // Lanes combined pairwise
+    BUILDER.SetInsertPoint(vecdone);
+    llvm::PHINode *Lanes = BUILDER.CreatePHI(Vec, 2, "LANES");
+    Lanes->addIncoming(VecInit, preheader);
+    Lanes->addIncoming(NextAcc, vecblock);
+    llvm::Value *Lane[LANES];
+    for (unsigned j = 0; j != LANES; j++) Lane[j] = BUILDER.CreateExtractElement(Lanes, (uint64_t)j);
+    llvm::Value *R = Step(Step(Lane[0], Lane[1]), Step(Lane[2], Lane[3]));
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSLT(VecEnd, Len), tailblock, afterblock);
+
+    // The rest one at a time
+    BUILDER.SetInsertPoint(tailblock);
+    llvm::PHINode *J = BUILDER.CreatePHI(I64, 2, "J");
+    llvm::PHINode *Acc = BUILDER.CreatePHI(Double, 2, "TACC");
+    J->addIncoming(VecEnd, vecdone);
+    Acc->addIncoming(R, vecdone);
+    llvm::Value *NextTail = Step(Acc, Elem(J, Double));
+    llvm::Value *NextJ = BUILDER.CreateNSWAdd(J, llvm::ConstantInt::get(I64, 1), "NEXTJ");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSLT(NextJ, Len), tailblock, afterblock);
+    J->addIncoming(NextJ, tailblock);
+    Acc->addIncoming(NextTail, tailblock);
+
+    BUILDER.SetInsertPoint(afterblock);
+    llvm::PHINode *PN = BUILDER.CreatePHI(Double, 2, "REDUCED");
+    PN->addIncoming(R, vecdone);
+    PN->addIncoming(NextTail, tailblock);
+    FunctionHasLoops = true;
+    return PN;
+}
+
+static llvm::Value *codegen_builtin(const ExprNode &N) {
+    auto Args = NODES->args(N);
+    llvm::Type *Double = llvm::Type::getDoubleTy(CONTEXT);
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    switch (N.Op) {
+        case B_LEN: {
+            llvm::Value *A = codegen_expr(Args[0]);
+            return A ? array_len(A) : nullptr;
+        }
+        case B_SUM:
+        case B_DOT:
+        case B_MIN:
+        case B_MAX:
+            return codegen_reduce(N.Op, Args);
+        case B_MAP: {
+            SymbolID Name = (*NODES)[Args[0]].A;
+            const ProtoFn &P = *function_protos[Name];
+            bool Intrinsic = P.getIntrinsic() != llvm::Intrinsic::not_intrinsic;
+            llvm::Function *F = Intrinsic ? nullptr : getFunction(Name);
+            if (!Intrinsic && !F) return log_errorv("Unknown function referenced.");
+            llvm::Value *A = codegen_expr(Args[1]);
+            if (!A) return nullptr;
+            llvm::Value *Len = array_len(A);
+            llvm::Value *Data = array_data(A);
+            llvm::Value *R = emit_array_new(Len, "MAPPED");
+            llvm::Value *RData = array_data(R);
+            emit_index_loop(Len, [&](llvm::Value *I) {
+                llvm::Value *X = convert(load_elements(Data, I, Double), T_DOUBLE, P.getArgTypes()[0]);
+                llvm::Value *Y = Intrinsic ? codegen_intrinsic(P, {X}) : BUILDER.CreateCall(F, {X}, "FX");
+                BUILDER.CreateAlignedStore(convert(Y, P.getReturnType(), T_DOUBLE),
+                                           BUILDER.CreateInBoundsGEP(RData, I), 8);
+            });
+            return R;
+        }
+        case B_RANGE: {
+            llvm::Value *Count = codegen_as(Args[0], T_INT);
+            if (!Count) return nullptr;
+            llvm::Value *Zero = llvm::ConstantInt::get(I64, 0);
+            llvm::Value *Len = BUILDER.CreateSelect(BUILDER.CreateICmpSGT(Count, Zero), Count, Zero, "LEN");
+            llvm::Value *R = emit_array_new(Len, "RANGE");
+            llvm::Value *RData = array_data(R);
+            emit_index_loop(Len, [&](llvm::Value *I) {
+                BUILDER.CreateAlignedStore(BUILDER.CreateSIToFP(I, Double), BUILDER.CreateInBoundsGEP(RData, I), 8);
+            });
+            return R;
+        }
+    }
+    return log_errorv("Unknown builtin.");
+}
+
+#endif
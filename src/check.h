@@ -0,0 +1,292 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "array.h"
+
+// --- Checking ---
+// Every body goes through check_body once it is parsed, before it is either
+// interpreted or code generated: the resolver binds its variables to frame
+// slots, then type inference gives every node a type. Both tiers read the
+// results from the nodes, so they agree on what a program means.
+
+static thread_local std::vector<unsigned> ScopeSlots; // By SymbolID, slot + 1, 0 when unbound
+static thread_local unsigned FrameSlots = 0;          // Slots handed out so far by the resolver
+
+
+
+//                  //
+// --- Resolver --- //
+//                  //
+
+// Binds every variable to a frame slot (parameters first, then each let and
+// loop variable its own) and checks calls.
+static bool resolve(ExprArena &Nodes, ExprRef E) {
+    ExprNode &N = Nodes.at(E);
+    switch (N.Kind) {
+        case NUM_EXPR:
+            return true;
+        case VAR_EXPR: {
+            unsigned Slot = symbol_slot(ScopeSlots, N.A);
+            if (!Slot) {
+                log_errorv("Unknown variable name.");
+                return false;
+            }
+            N.B = Slot - 1;
+            return true;
+        }
+        case OP_EXPR:
+            return resolve(Nodes, N.A) && resolve(Nodes, N.B);
+        case CALL_EXPR: {
+            auto &P = symbol_slot(function_protos, N.A);
+            if (!P) {
+                int B = builtin_id(SYMBOLS.name(N.A)); // Only names no definition has taken
+                if (B < 0) {
+                    log_errorv("Unknown function referenced.");
+                    return false;
+                }
+                N.Kind = BUILTIN_EXPR;
+                N.Op = B;
+                return resolve(Nodes, E);
+            }
+            if (P->getArgs().size() != N.C) {
+                log_errorv("Incorrect number of arguments.");
+                return false;
+            }
+            for (ExprRef Arg : Nodes.args(N))
+                if (!resolve(Nodes, Arg)) return false;
+            return true;
+        }
+        case IF_EXPR:
+            return resolve(Nodes, N.A) && resolve(Nodes, N.B) && resolve(Nodes, N.C);
+        case FOR_EXPR: {
+            auto Parts = Nodes.loop(N);
+            if (!resolve(Nodes, Parts[0]) || !resolve(Nodes, Parts[1])) return false;
+            if (Parts[2] && !resolve(Nodes, Parts[2])) return false;
+            // The variable gets its own slot, visible in the body only
+            unsigned Shadowed = symbol_slot(ScopeSlots, N.A);
+            N.C = FrameSlots++;
+            ScopeSlots[N.A] = N.C + 1;
+            bool OK = resolve(Nodes, Parts[3]);
+            ScopeSlots[N.A] = Shadowed;
+            return OK;
+        }
+        case SEQ_EXPR: {
+            llvm::SmallVector<std::pair<SymbolID, unsigned>, 4> Shadowed;
+            bool OK = true;
+            for (ExprRef Item : Nodes.args(N)) {
+                if (Nodes[Item].Kind == LET_EXPR)
+                    Shadowed.push_back(std::make_pair(Nodes[Item].A, symbol_slot(ScopeSlots, Nodes[Item].A)));
+                if (!(OK = resolve(Nodes, Item))) break;
+            }
+            for (auto It = Shadowed.rbegin(); It != Shadowed.rend(); ++It) // Leave scope
+                ScopeSlots[It->first] = It->second;
+            return OK;
+        }
+        case LET_EXPR:
+            // The initializer still sees the binding the let shadows
+            if (!resolve(Nodes, N.B)) return false;
+            N.C = FrameSlots++;
+            symbol_slot(ScopeSlots, N.A) = N.C + 1; // Until the block ends
+            return true;
+        case ASSIGN_EXPR: {
+            unsigned Slot = symbol_slot(ScopeSlots, N.A);
+            if (!Slot) {
+                log_errorv("Unknown variable name.");
+                return false;
+            }
+            N.C = Slot - 1;
+            return resolve(Nodes, N.B);
+        }
+        case INDEX_EXPR:
+            return resolve(Nodes, N.A) && resolve(Nodes, N.B);
+        case BUILTIN_EXPR: {
+            auto Args = Nodes.args(N);
+            if (Args.size() != BUILTINS[(int)N.Op].Arity) {
+                log_errorv("Incorrect number of arguments.");
+                return false;
+            }
+            for (unsigned i = 0; i != Args.size(); i++) {
+                if (N.Op == B_MAP && i == 0) { // The function to apply, named
+                    const ExprNode &Fn = Nodes[Args[0]];
+                    ProtoFn *FP = Fn.Kind == VAR_EXPR ? symbol_slot(function_protos, Fn.A).get() : nullptr;
+                    if (!FP || FP->getArgs().size() != 1) {
+                        log_errorv("map expects the name of a function of one argument.");
+                        return false;
+                    }
+                    continue;
+                }
+                if (!resolve(Nodes, Args[i])) return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool resolve_body(llvm::ArrayRef<SymbolID> Params, ExprArena &Nodes, ExprRef Root, unsigned &NumSlots) {
+    unsigned Slot = 0;
+    for (SymbolID Param : Params) symbol_slot(ScopeSlots, Param) = ++Slot;
+    FrameSlots = Slot;
+    bool OK = resolve(Nodes, Root);
+    for (SymbolID Param : Params) ScopeSlots[Param] = 0; // Leave scope
+    NumSlots = FrameSlots;
+    return OK;
+}
+
+
+
+//               //
+// --- Types --- //
+//               //
+
+// Local inference over one body. A let's type is the join of its
+// initializer and everything assigned to it, a parameter's is fixed by the
+// prototype, and the return type (unless declared) is the body's. Types
+// only widen, so walking the body until nothing changes terminates; the
+// last walk, with Check set, reports conversions that would narrow and
+// arrays used where a scalar is expected or the other way around.
+
+struct Inference {
+    ExprArena &Nodes;
+    std::vector<ValueType> Slots; // By frame slot
+    unsigned NumParams;
+    SymbolID Self;                // Calls to it have type Ret
+    ValueType Ret;
+    bool Changed = false;
+    bool Check = false;
+    bool OK = true;
+    Inference(ExprArena &Nodes, unsigned NumSlots, unsigned NumParams, SymbolID Self, ValueType Ret)
+        : Nodes(Nodes), Slots(NumSlots, T_NONE), NumParams(NumParams), Self(Self), Ret(Ret) {}
+};
+
+static void widen(Inference &I, ValueType &T, ValueType New) {
+    if (New <= T) return;
+    T = New;
+    I.Changed = true;
+}
+
+static void check_fits(Inference &I, ValueType From, ValueType To) {
+    if (!I.Check || fits(From, To)) return;
+    char Msg[64];
+    snprintf(Msg, sizeof(Msg), "Type mismatch: %s where %s expected.", type_name(From), type_name(To));
+    log_error(Msg);
+    I.OK = false;
+}
+
+static ValueType infer(Inference &I, ExprRef E) {
+    ExprNode &N = I.Nodes.at(E);
+    switch (N.Kind) {
+        case NUM_EXPR:
+            break; // Typed by the parser
+        case VAR_EXPR:
+            N.Type = I.Slots[N.B];
+            break;
+        case OP_EXPR: {
+            ValueType L = infer(I, N.A);
+            ValueType R = infer(I, N.B);
+            check_fits(I, L, T_DOUBLE);
+            check_fits(I, R, T_DOUBLE);
+            if (N.Op == '/') N.Type = T_DOUBLE;
+            else if (N.Op == '<' || N.Op == '>' || N.Op == '=') N.Type = T_BOOL;
+            else N.Type = arith_type(join_types(L, R));
+            break;
+        }
+        case CALL_EXPR: {
+            const ProtoFn &P = *function_protos[N.A];
+            auto Args = I.Nodes.args(N);
+            for (unsigned i = 0; i != Args.size(); i++)
+                check_fits(I, infer(I, Args[i]), P.getArgTypes()[i]);
+            N.Type = N.A == I.Self ? I.Ret : P.getReturnType();
+            break;
+        }
+        case IF_EXPR: {
+            check_fits(I, infer(I, N.A), T_DOUBLE); // Any scalar tests against zero
+            ValueType Body = infer(I, N.B);
+            ValueType Else = infer(I, N.C);
+            N.Type = join_types(Body, Else);
+            check_fits(I, Body, N.Type);
+            check_fits(I, Else, N.Type);
+            break;
+        }
+        case FOR_EXPR: {
+            auto Parts = I.Nodes.loop(N);
+            ValueType Bounds = join_types(infer(I, Parts[0]), infer(I, Parts[1]));
+            if (Parts[2]) Bounds = join_types(Bounds, infer(I, Parts[2]));
+            check_fits(I, Bounds, T_DOUBLE);
+            widen(I, I.Slots[N.C], arith_type(Bounds));
+            ValueType Body = infer(I, Parts[3]);
+            check_fits(I, Body, T_DOUBLE);
+            N.Type = arith_type(Body);
+            N.Op = I.Slots[N.C]; // After the body, which may assign it
+            break;
+        }
+        case SEQ_EXPR:
+            for (ExprRef Item : I.Nodes.args(N)) N.Type = infer(I, Item);
+            break;
+        case LET_EXPR:
+        case ASSIGN_EXPR: {
+            ValueType T = infer(I, N.B);
+            if (N.Kind == LET_EXPR || N.C >= I.NumParams) widen(I, I.Slots[N.C], T);
+            check_fits(I, T, I.Slots[N.C]);
+            N.Type = I.Slots[N.C];
+            break;
+        }
+        case INDEX_EXPR:
+            check_fits(I, infer(I, N.A), T_ARRAY);
+            check_fits(I, infer(I, N.B), T_INT);
+            N.Type = T_DOUBLE;
+            break;
+        case BUILTIN_EXPR: {
+            auto Args = I.Nodes.args(N);
+            if (N.Op == B_MAP) {
+                SymbolID Fn = I.Nodes[Args[0]].A;
+                const ProtoFn &P = *function_protos[Fn];
+                check_fits(I, T_DOUBLE, P.getArgTypes()[0]);
+                check_fits(I, Fn == I.Self ? I.Ret : P.getReturnType(), T_DOUBLE);
+                check_fits(I, infer(I, Args[1]), T_ARRAY);
+                N.Type = T_ARRAY;
+            } else if (N.Op == B_RANGE) {
+                check_fits(I, infer(I, Args[0]), T_INT);
+                N.Type = T_ARRAY;
+            } else {
+                for (ExprRef Arg : Args) check_fits(I, infer(I, Arg), T_ARRAY);
+                N.Type = N.Op == B_LEN ? T_INT : T_DOUBLE;
+            }
+            break;
+        }
+    }
+    return N.Type;
+}
+
+// Resolves and types the body of P, or of a top-level expression when P is
+// null (which, like a compiled one, returns a double), and sets P's return
+// type.
+static bool check_body(ProtoFn *P, ExprArena &Nodes, ExprRef Root, unsigned &NumSlots) {
+    StageScope Timing(STAGE_CHECK);
+    llvm::ArrayRef<SymbolID> Params;
+    if (P) Params = P->getArgs();
+    if (!resolve_body(Params, Nodes, Root, NumSlots)) return false;
+
+    bool Declared = !P || P->hasDeclaredReturn();
+    Inference I(Nodes, NumSlots, Params.size(), P ? P->getName() : NO_SYMBOL,
+                !P ? T_DOUBLE : Declared ? P->getReturnType() : T_NONE);
+    for (unsigned i = 0; i != Params.size(); i++) I.Slots[i] = P->getArgTypes()[i];
+    while (1) {
+        I.Changed = false;
+        ValueType T = infer(I, Root);
+        if (!Declared) widen(I, I.Ret, T);
+        if (I.Changed) continue;
+        if (I.Ret == T_NONE) { // Never returns but through itself
+            I.Ret = T_DOUBLE;
+            continue;
+        }
+        break;
+    }
+    I.Check = true;
+    ValueType T = infer(I, Root);
+    check_fits(I, T, I.Ret);
+    if (I.OK && P) P->setReturnType(I.Ret);
+    return I.OK;
+}
+
+#endif
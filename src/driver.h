@@ -0,0 +1,149 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include "parser.h"
+#include <mutex>
+
+// --- Driver ---
+// What the tlang executable and libtlang (libtlang.cpp) share: command line
+// options and bringing up the JIT they describe.
+
+// --- Options ---
+
+static thread_local std::string CacheDir;                      // Empty disables the object cache
+static thread_local uint64_t CacheBytes = 256ull * 1024 * 1024;
+static thread_local int TopBatchOption = -1;                   // Top-level expressions per module, -1 = default
+static thread_local std::string TargetCPU;                     // Empty targets the host CPU
+static thread_local std::vector<std::string> TargetAttrs;      // Extra -mattr features, "+avx2"
+
+static bool parse_option(llvm::StringRef Arg) {
+    if (Arg == "-no-cache") {
+        CacheDir.clear();
+        return true;
+    }
+    if (Arg.startswith("-cache-dir=")) {
+        CacheDir = Arg.substr(strlen("-cache-dir=")).str();
+        return true;
+    }
+    if (Arg.startswith("-cache-size=")) { // Megabytes
+        uint64_t MB;
+        if (Arg.substr(strlen("-cache-size=")).getAsInteger(10, MB)) return false;
+        CacheBytes = MB * 1024 * 1024;
+        return true;
+    }
+    if (Arg.size() == 3 && Arg.startswith("-O") && Arg[2] >= '0' && Arg[2] <= '3') {
+        OptLevel = Arg[2] - '0';
+        return true;
+    }
+    if (Arg == "-time-stages") {
+        TimeStages = StageTiming = true;
+        return true;
+    }
+    if (Arg.startswith("-time-json=")) {
+        StagesJSON = Arg.substr(strlen("-time-json=")).str();
+        StageTiming = true;
+        return !StagesJSON.empty();
+    }
+    if (Arg == "-time-opt") {
+        TimeOpt = true;
+        return true;
+    }
+    if (Arg == "-fast-math" || Arg == "--fast-math") {
+        FastMath = true;
+        return true;
+    }
+    if (Arg.startswith("-tier-threshold=")) { // 0 compiles everything
+        if (Arg.substr(strlen("-tier-threshold=")).getAsInteger(10, HotThreshold)) return false;
+        return true;
+    }
+    if (Arg.startswith("-batch=")) {
+        unsigned N;
+        if (Arg.substr(strlen("-batch=")).getAsInteger(10, N) || N == 0) return false;
+        TopBatchOption = N;
+        return true;
+    }
+    if (Arg.startswith("-mcpu=")) {
+        TargetCPU = Arg.substr(strlen("-mcpu=")).str();
+        return true;
+    }
+    if (Arg.startswith("-mattr=")) {
+        llvm::SmallVector<llvm::StringRef, 8> Attrs;
+        Arg.substr(strlen("-mattr=")).split(Attrs, ',', -1, false);
+        for (llvm::StringRef A : Attrs) {
+            if (A[0] != '+' && A[0] != '-') return false;
+            TargetAttrs.push_back(A.str());
+        }
+        return true;
+    }
+    if (Arg.startswith("-mversions=")) // avx2+fma,avx512f
+        return parse_versions(Arg.substr(strlen("-mversions=")));
+    if (Arg.startswith("-memo-size=")) { // Entries per memo function
+        if (Arg.substr(strlen("-memo-size=")).getAsInteger(10, MemoSize) || MemoSize == 0 || MemoSize > (1u << 30))
+            return false;
+        return true;
+    }
+    if (Arg == "-memo-evict=replace" || Arg == "-memo-evict=keep") {
+        MemoKeep = Arg.endswith("keep");
+        return true;
+    }
+    if (Arg.startswith("-perf=")) // map,jitdump
+        return parse_profile_option(Arg.substr(strlen("-perf=")));
+    if (Arg.startswith("-veclib=")) {
+        llvm::StringRef Lib = Arg.substr(strlen("-veclib="));
+        if (Lib != "libmvec" && Lib != "none") return false;
+        VecLib = Lib == "none" ? "" : Lib.str();
+        return true;
+    }
+    return false;
+}
+
+// Back to the defaults, for a libtlang session opened after another
+static void reset_options() {
+    CacheDir.clear();
+    CacheBytes = 256ull * 1024 * 1024;
+    TopBatchOption = -1;
+    TargetCPU.clear();
+    TargetAttrs.clear();
+    OptLevel = 1;
+    FastMath = false;
+    HotThreshold = 1000;
+    CodeVersions.clear();
+    MemoSize = 4096;
+    MemoKeep = false;
+    VecLib.clear();
+}
+
+// --- Startup ---
+
+// Once per process, whichever session comes first, before any option is read
+static void initialize_native() {
+    static std::once_flag Once;
+    std::call_once(Once, [] {
+        LLVMInitializeNativeTarget();
+        LLVMInitializeNativeAsmPrinter();
+        LLVMInitializeNativeAsmParser();
+        register_array_runtime();
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init(); // Links in and fills __cpu_model for multiversioned code
+#endif
+    });
+}
+
+// The JIT, optimizer and object cache the options describe, the session's
+// runtime, and a first module. Lazy compiles each function on its first call.
+static void start_jit(bool Lazy = true) {
+    static const llvm::CodeGenOpt::Level CodeGenLevels[] = {
+        llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less, llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive
+    };
+    jit = llvm::make_unique<llvm::orc::KaleidoscopeJIT>(CodeGenLevels[OptLevel], TargetCPU, TargetAttrs, Lazy);
+    RUNTIME = llvm::make_unique<Runtime>();
+    jit->defineSymbol("__tlang_runtime", RUNTIME.get());
+    OPT = llvm::make_unique<Optimizer>(&jit->getTargetMachine());
+    if (!CacheDir.empty()) {
+        OBJCACHE = llvm::make_unique<DiskObjectCache>(CacheDir, CacheBytes, jit->getTargetMachine());
+        jit->setObjectCache(OBJCACHE.get());
+    }
+    initialize_module();
+}
+
+#endif
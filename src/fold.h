@@ -0,0 +1,126 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include "check.h"
+
+// --- Constant folding ---
+// Runs on every checked body, before either tier sees it. Operators whose
+// operands are both literals become literals, an if on a literal condition
+// becomes the branch it takes, and a block of nothing but literals becomes
+// its last one. Nodes are rewritten in place and keep their type, so the
+// rest of the tree reads them as before. Folding evaluates with the
+// interpreter's semantics below, which are the generated code's (strict IEEE
+// and wrapping integers, also inside fast functions), so a folded program
+// computes what the unfolded one would have.
+//
+// A top-level expression that folds to a literal is answered on the spot,
+// without building or compiling a module.
+
+// Conversions match convert() in the generated code
+static Value convert_value(Value V, ValueType From, ValueType To) {
+    if (From == To || From == T_NONE || To == T_NONE) return V;
+    Value R;
+    switch (To) {
+        case T_BOOL: R.I = From == T_INT ? V.I != 0 : (V.D < 0.0 || V.D > 0.0); break;
+        case T_INT: R.I = From == T_BOOL ? V.I : (int64_t)V.D; break;
+        default: R.D = (double)V.I; break;
+    }
+    return R;
+}
+
+// Integer arithmetic wraps around as the i64 instructions do
+static Value interp_op(char Op, ValueType T, Value L, Value R) {
+    Value V;
+    if (T == T_INT) {
+        uint64_t A = L.I, B = R.I;
+        switch (Op) {
+            case '+': V.I = (int64_t)(A + B); break;
+            case '-': V.I = (int64_t)(A - B); break;
+            case '*': V.I = (int64_t)(A * B); break;
+            case '<': V.I = L.I < R.I; break;
+            case '>': V.I = L.I > R.I; break;
+            default:  V.I = L.I == R.I; break;
+        }
+        return V;
+    }
+    switch (Op) {
+        case '+': V.D = L.D + R.D; break;
+        case '-': V.D = L.D - R.D; break;
+        case '*': V.D = L.D * R.D; break;
+        case '/': V.D = L.D / R.D; break;
+        case '<': V.I = !(L.D >= R.D); break;
+        case '>': V.I = !(L.D <= R.D); break;
+        default:  V.I = !(L.D < R.D || L.D > R.D); break;
+    }
+    return V;
+}
+// Makes E a literal of its own type holding V, a value of type From
+static void fold_to(ExprArena &Nodes, ExprRef E, Value V, ValueType From) {
+    Nodes.make_constant(E, convert_value(V, From, Nodes[E].Type));
+}
+
+static void fold(ExprArena &Nodes, ExprRef E) {
+    ExprNode &N = Nodes.at(E);
+    switch (N.Kind) {
+        case NUM_EXPR:
+        case VAR_EXPR:
+            return;
+        case OP_EXPR: {
+            fold(Nodes, N.A);
+            fold(Nodes, N.B);
+            const ExprNode &A = Nodes[N.A], &B = Nodes[N.B];
+            if (A.Kind != NUM_EXPR || B.Kind != NUM_EXPR) return;
+            ValueType T = N.Op == '/' ? T_DOUBLE : arith_type(join_types(A.Type, B.Type));
+            Value L = convert_value(Nodes.value(A), A.Type, T);
+            Value R = convert_value(Nodes.value(B), B.Type, T);
+            Nodes.make_constant(E, interp_op(N.Op, T, L, R)); // Already of N's type
+            return;
+        }
+        case IF_EXPR: {
+            fold(Nodes, N.A);
+            fold(Nodes, N.B);
+            fold(Nodes, N.C);
+            const ExprNode &C = Nodes[N.A];
+            if (C.Kind != NUM_EXPR) return;
+            const ExprNode &Taken = Nodes[convert_value(Nodes.value(C), C.Type, T_BOOL).I ? N.B : N.C];
+            if (Taken.Kind == NUM_EXPR) fold_to(Nodes, E, Nodes.value(Taken), Taken.Type);
+            else if (Taken.Type == N.Type) N = Taken; // Tail marks carry over, the position is the same
+            return;
+        }
+        case FOR_EXPR:
+            for (ExprRef Part : Nodes.loop(N))
+                if (Part) fold(Nodes, Part);
+            return;
+        case SEQ_EXPR: {
+            bool Literals = true;
+            for (ExprRef Item : Nodes.args(N)) {
+                fold(Nodes, Item);
+                Literals &= Nodes[Item].Kind == NUM_EXPR;
+            }
+            ExprRef Last = Nodes.args(N).back();
+            if (Literals) fold_to(Nodes, E, Nodes.value(Nodes[Last]), Nodes[Last].Type);
+            return;
+        }
+        case LET_EXPR:
+        case ASSIGN_EXPR:
+            fold(Nodes, N.B);
+            return;
+        case INDEX_EXPR:
+            fold(Nodes, N.A);
+            fold(Nodes, N.B);
+            return;
+        case CALL_EXPR:
+        case BUILTIN_EXPR:
+            for (ExprRef Arg : Nodes.args(N)) fold(Nodes, Arg); // map's function name is a VAR, left alone
+            return;
+    }
+}
+
+// Folds a checked body, true when all that is left of it is a literal
+static bool fold_body(ExprArena &Nodes, ExprRef Root) {
+    StageScope Timing(STAGE_CHECK);
+    fold(Nodes, Root);
+    return Nodes[Root].Kind == NUM_EXPR;
+}
+
+#endif
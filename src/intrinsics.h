@@ -0,0 +1,89 @@
+#ifndef INTRINSICS_H
+#define INTRINSICS_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Target/TargetMachine.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// --- Math intrinsics ---
+// import sqrt(x), import sin(x), ... of a libm name with the libm signature
+// (every argument and the result a double) is called through the matching
+// LLVM intrinsic instead of an opaque external call. LLVM then folds calls
+// on constants, knows they have no side effects (so they are hoisted out of
+// loops and vectorized) and emits sqrt, fabs, floor, fma, ... as single
+// instructions. Intrinsics that have no instruction (sin, exp, pow, ...) are
+// still calls to the same libm functions in the end. Any other import, or one
+// with another signature, stays an external call resolved in the process.
+//
+// -veclib=libmvec additionally tells the loop vectorizer about glibc's vector
+// math library, so a loop calling sin, cos, exp, log or pow is vectorized
+// with calls to _ZGVdN4v_sin and friends. Those are accurate to a few ulp
+// rather than correctly rounded like the scalar ones, so results may change
+// in the last bits. Only the variants the target's features allow are used.
+
+// not_intrinsic when Name/NumArgs is not a mapped libm function
+static llvm::Intrinsic::ID math_intrinsic(llvm::StringRef Name, unsigned NumArgs) {
+    struct Entry {
+        llvm::Intrinsic::ID ID;
+        unsigned Arity;
+    };
+    Entry E = llvm::StringSwitch<Entry>(Name)
+        .Case("sqrt", {llvm::Intrinsic::sqrt, 1})
+        .Case("sin", {llvm::Intrinsic::sin, 1})
+        .Case("cos", {llvm::Intrinsic::cos, 1})
+        .Case("exp", {llvm::Intrinsic::exp, 1})
+        .Case("exp2", {llvm::Intrinsic::exp2, 1})
+        .Case("log", {llvm::Intrinsic::log, 1})
+        .Case("log2", {llvm::Intrinsic::log2, 1})
+        .Case("log10", {llvm::Intrinsic::log10, 1})
+        .Case("fabs", {llvm::Intrinsic::fabs, 1})
+        .Case("floor", {llvm::Intrinsic::floor, 1})
+        .Case("ceil", {llvm::Intrinsic::ceil, 1})
+        .Case("trunc", {llvm::Intrinsic::trunc, 1})
+        .Case("round", {llvm::Intrinsic::round, 1})
+        .Case("rint", {llvm::Intrinsic::rint, 1})
+        .Case("nearbyint", {llvm::Intrinsic::nearbyint, 1})
+        .Case("pow", {llvm::Intrinsic::pow, 2})
+        .Case("fmin", {llvm::Intrinsic::minnum, 2})
+        .Case("fmax", {llvm::Intrinsic::maxnum, 2})
+        .Case("copysign", {llvm::Intrinsic::copysign, 2})
+        .Case("fma", {llvm::Intrinsic::fma, 3})
+        .Default({llvm::Intrinsic::not_intrinsic, 0});
+    return E.Arity == NumArgs ? E.ID : llvm::Intrinsic::not_intrinsic;
+}
+
+static thread_local std::string VecLib; // -veclib=, empty for none
+
+// Loads the vector library named by -veclib so the JIT can resolve it
+static bool load_vector_library(std::string &Err) {
+    if (VecLib.empty()) return true;
+    return !llvm::sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1", &Err);
+}
+
+// Registers the vector variants of libm functions with TLII
+static void add_vector_library(llvm::TargetLibraryInfoImpl &TLII, const llvm::TargetMachine &TM) {
+    if (VecLib.empty()) return;
+    llvm::StringRef Features = TM.getTargetFeatureString();
+    bool AVX2 = Features.contains("+avx2"), AVX512 = Features.contains("+avx512f");
+
+    // glibc's x86-64 vector ABI: b = SSE (2 lanes), d = AVX2 (4), e = AVX-512 (8)
+    std::vector<llvm::VecDesc> Descs;
+    for (const char *Fn : {"sin", "cos", "exp", "log", "pow"}) {
+        std::string Params = llvm::StringRef(Fn) == "pow" ? "vv_" : "v_";
+        for (std::string Scalar : {std::string(Fn), "llvm." + std::string(Fn) + ".f64"}) {
+            Descs.push_back({strdup(Scalar.c_str()), strdup(("_ZGVbN2" + Params + Fn).c_str()), 2});
+            if (AVX2) Descs.push_back({strdup(Scalar.c_str()), strdup(("_ZGVdN4" + Params + Fn).c_str()), 4});
+            if (AVX512) Descs.push_back({strdup(Scalar.c_str()), strdup(("_ZGVeN8" + Params + Fn).c_str()), 8});
+        }
+    }
+    TLII.addVectorizableFunctions(Descs); // Names are kept for the whole session
+}
+
+#endif
@@ -16,22 +16,30 @@
 
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "perf.h"
+#include "stages.h"
 #include <algorithm>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -40,19 +48,92 @@ namespace orc {
 
 class KaleidoscopeJIT {
 public:
-  typedef RTDyldObjectLinkingLayer<> ObjLayerT;
+  // Hands every object the linker loads to the profiler support (perf.h)
+  struct NotifyProfiler {
+    template <typename ObjSetT, typename LoadResult>
+    void operator()(RTDyldObjectLinkingLayerBase::ObjSetHandleT,
+                    const ObjSetT &Objects, const LoadResult &Infos) {
+      for (size_t I = 0; I != Objects.size(); ++I)
+        profile_loaded_object(*Objects[I]->getBinary(), *Infos[I]);
+    }
+  };
+
+  typedef RTDyldObjectLinkingLayer<NotifyProfiler> ObjLayerT;
   typedef IRCompileLayer<ObjLayerT> CompileLayerT;
-  typedef CompileLayerT::ModuleSetHandleT ModuleHandleT;
+  typedef CompileOnDemandLayer<CompileLayerT> CODLayerT;
 
-  KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+  // A module in the layer it was added to, see Lazy below
+  struct ModuleHandleT {
+    bool Lazy = true;
+    CODLayerT::ModuleSetHandleT COD;
+    CompileLayerT::ModuleSetHandleT Compiled;
+
+    bool operator==(const ModuleHandleT &O) const {
+      return Lazy ? COD == O.COD : Compiled == O.Compiled;
+    }
+  };
+
+  // Lazy modules go through the compile-on-demand layer: every function gets
+  // an indirect stub, and is extracted into its own module and compiled only
+  // when the stub is first called. Definitions that are never called are
+  // never lowered to machine code. Otherwise a module is compiled as it is
+  // added, and linked on the first lookup, so that its code never calls back
+  // into the JIT (libtlang, whose functions run on any thread).
+  // Code is generated for the host CPU and every feature it reports, unless
+  // a CPU name is given; extra attributes ("+avx2", "-avx512f") come last
+  // and override either.
+  KaleidoscopeJIT(CodeGenOpt::Level OptLevel = CodeGenOpt::Default,
+                  const std::string &CPU = "",
+                  const std::vector<std::string> &Attrs = std::vector<std::string>(),
+                  bool Lazy = true)
+      : Lazy(Lazy),
+        TM(EngineBuilder()
+               .setOptLevel(OptLevel)
+               .setMCPU(CPU.empty() ? sys::getHostCPUName() : StringRef(CPU))
+               .setMAttrs(targetAttrs(CPU, Attrs))
+               .selectTarget()),
+        DL(TM->createDataLayout()),
+        ObjectLayer(NotifyProfiler(),
+                    [](RTDyldObjectLinkingLayerBase::ObjSetHandleT) {
+                      profile_finalized_objects();
+                    }),
+        CompileLayer(ObjectLayer,
+                     [this](Module &M) {
+                       StageScope Timing(STAGE_JIT); // Lazy, inside whoever called the stub
+                       return SimpleCompiler(*TM)(M);
+                     }),
+        CompileCallbackManager(
+            createLocalCompileCallbackManager(TM->getTargetTriple(), 0)),
+        CODLayer(CompileLayer,
+                 [](Function &F) { return std::set<Function *>({&F}); },
+                 *CompileCallbackManager,
+                 createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  // Consulted before compiling each module, and handed every new object.
+  void setObjectCache(ObjectCache *Cache) { CompileLayer.setObjectCache(Cache); }
+
+  // Resolves Name to Addr for this JIT's modules alone, ahead of the process.
+  void defineSymbol(const std::string &Name, void *Addr) {
+    SymbolCache[mangle(Name)] =
+        std::make_pair((JITTargetAddress)(uintptr_t)Addr, JITSymbolFlags::Exported);
+  }
+
+  // Drops a defineSymbol() name once nothing linked against it remains.
+  void undefineSymbol(const std::string &Name) { SymbolCache.erase(mangle(Name)); }
+
   ModuleHandleT addModule(std::unique_ptr<Module> M) {
+    // Names defined here shadow whatever the symbol cache resolved them to.
+    std::vector<std::string> Defined;
+    for (auto &F : *M)
+      if (!F.isDeclaration())
+        Defined.push_back(mangle(F.getName()));
+    for (auto &Name : Defined)
+      SymbolCache.erase(Name);
+
     // We need a memory manager to allocate memory and resolve symbols for this
     // new module. Create one that resolves symbols by looking back into the
     // JIT.
@@ -63,24 +144,88 @@ public:
           return JITSymbol(nullptr);
         },
         [](const std::string &S) { return nullptr; });
-    auto H = CompileLayer.addModuleSet(singletonSet(std::move(M)),
-                                       make_unique<SectionMemoryManager>(),
-                                       std::move(Resolver));
+    ++Counters.Modules;
+    ModuleHandleT H;
+    H.Lazy = Lazy;
+    if (Lazy)
+      H.COD = CODLayer.addModuleSet(singletonSet(std::move(M)),
+                                    make_unique<CountingMemoryManager>(),
+                                    std::move(Resolver));
+    else
+      H.Compiled = CompileLayer.addModuleSet(singletonSet(std::move(M)),
+                                             make_unique<CountingMemoryManager>(),
+                                             std::move(Resolver));
 
     ModuleHandles.push_back(H);
+    ModuleSymbols.push_back(std::move(Defined));
     return H;
   }
 
   void removeModule(ModuleHandleT H) {
-    ModuleHandles.erase(find(ModuleHandles, H));
-    CompileLayer.removeModuleSet(H);
+    auto I = find(ModuleHandles, H);
+    auto &Defined = ModuleSymbols[I - ModuleHandles.begin()];
+    for (auto &Name : Defined)
+      SymbolCache.erase(Name);
+    ModuleSymbols.erase(ModuleSymbols.begin() + (I - ModuleHandles.begin()));
+    ModuleHandles.erase(I);
+    if (H.Lazy)
+      CODLayer.removeModuleSet(H.COD);
+    else
+      CompileLayer.removeModuleSet(H.Compiled);
   }
 
   JITSymbol findSymbol(const std::string Name) {
+    StageScope Timing(STAGE_LOOKUP);
     return findMangledSymbol(mangle(Name));
   }
 
+  // Name as module H defines it, even if a later module shadows it.
+  JITSymbol findSymbolIn(ModuleHandleT H, const std::string &Name) {
+    StageScope Timing(STAGE_LOOKUP);
+    return findMangledSymbolIn(H, mangle(Name), true);
+  }
+
 private:
+  // Counts the sections objects are loaded into. A module's memory manager
+  // lives until the module is removed, and takes its bytes with it.
+  class CountingMemoryManager : public SectionMemoryManager {
+    uint64_t Bytes = 0;
+
+  public:
+    ~CountingMemoryManager() override { Counters.LiveBytes -= Bytes; }
+
+    uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned SectionID,
+                                 StringRef SectionName) override {
+      Counters.CodeBytes += Size;
+      Counters.LiveBytes += Size;
+      Bytes += Size;
+      return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                       SectionID, SectionName);
+    }
+
+    uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned SectionID, StringRef SectionName,
+                                 bool IsReadOnly) override {
+      Counters.DataBytes += Size;
+      Counters.LiveBytes += Size;
+      Bytes += Size;
+      return SectionMemoryManager::allocateDataSection(
+          Size, Alignment, SectionID, SectionName, IsReadOnly);
+    }
+  };
+
+  static std::vector<std::string> targetAttrs(const std::string &CPU,
+                                              const std::vector<std::string> &Extra) {
+    std::vector<std::string> Attrs;
+    StringMap<bool> HostFeatures;
+    if (CPU.empty() && sys::getHostCPUFeatures(HostFeatures))
+      for (auto &F : HostFeatures)
+        Attrs.push_back((F.second ? "+" : "-") + F.first().str());
+    Attrs.insert(Attrs.end(), Extra.begin(), Extra.end());
+    return Attrs;
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -96,7 +241,27 @@ private:
     return Vec;
   }
 
+  // Resolved addresses are cached by mangled name, so repeated lookups (every
+  // relocation against a REPL function, every top-level expression) are one
+  // hash probe instead of a walk over all module handles.
+  JITSymbol cacheSymbol(const std::string &Name, JITSymbol Sym) {
+    JITTargetAddress Addr = Sym.getAddress();
+    SymbolCache[Name] = std::make_pair(Addr, Sym.getFlags());
+    return JITSymbol(Addr, Sym.getFlags());
+  }
+
+  JITSymbol findMangledSymbolIn(ModuleHandleT H, const std::string &Name,
+                                bool ExportedSymbolsOnly) {
+    if (H.Lazy)
+      return CODLayer.findSymbolIn(H.COD, Name, ExportedSymbolsOnly);
+    return CompileLayer.findSymbolIn(H.Compiled, Name, ExportedSymbolsOnly);
+  }
+
   JITSymbol findMangledSymbol(const std::string &Name) {
+    auto Cached = SymbolCache.find(Name);
+    if (Cached != SymbolCache.end())
+      return JITSymbol(Cached->second.first, Cached->second.second);
+
 #ifdef LLVM_ON_WIN32
     // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
     // flag to decide whether a symbol will be visible or not, when we call
@@ -114,12 +279,12 @@ private:
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
     for (auto H : make_range(ModuleHandles.rbegin(), ModuleHandles.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
-        return Sym;
+      if (auto Sym = findMangledSymbolIn(H, Name, ExportedSymbolsOnly))
+        return cacheSymbol(Name, std::move(Sym));
 
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
-      return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+      return cacheSymbol(Name, JITSymbol(SymAddr, JITSymbolFlags::Exported));
 
 #ifdef LLVM_ON_WIN32
     // For Windows retry without "_" at begining, as RTDyldMemoryManager uses
@@ -134,11 +299,16 @@ private:
     return nullptr;
   }
 
+  const bool Lazy;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
+  std::unique_ptr<JITCompileCallbackManager> CompileCallbackManager;
+  CODLayerT CODLayer;
   std::vector<ModuleHandleT> ModuleHandles;
+  std::vector<std::vector<std::string>> ModuleSymbols; // Parallel to ModuleHandles
+  StringMap<std::pair<JITTargetAddress, JITSymbolFlags>> SymbolCache;
 };
 
 } // end namespace orc
@@ -0,0 +1,236 @@
+// -------------------------------------- //
+// Charles Timmerman - cttimm4427@ung.edu //
+// -------------------------------------- //
+
+// The C API of libtlang.h, over the same compiler the tlang executable runs.
+// Every definition is compiled (no interpreter tier), each tlang_compile()
+// becomes one JIT module, and its functions get a __tier_ trampoline so that
+// tlang_call() can pass arguments it only knows at run time. Modules are
+// compiled and linked before tlang_compile() returns, and the runtime they
+// call is the session's, so the functions run on any thread without ever
+// calling back into the compiler, whose state is the opening thread's.
+
+#include "driver.h"
+#include "libtlang.h"
+
+static_assert(sizeof(tlang_value) == sizeof(Value), "tlang_value is a Value");
+static_assert(sizeof(tlang_array) == sizeof(Array), "tlang_array is an Array");
+
+struct tlang_function {
+    SymbolID Symbol;
+    std::string Name; // For tlang_lookup() on threads that do not know the symbol
+    ValueType RetType;
+    std::vector<ValueType> ArgTypes;
+    void *Address = nullptr;
+    int64_t (*Entry)(const Value *Args) = nullptr; // Its trampoline
+};
+
+struct tlang_module {
+    llvm::orc::KaleidoscopeJIT::ModuleHandleT Handle; // Only when there are functions
+    std::vector<std::unique_ptr<tlang_function>> Functions;
+    std::vector<std::unique_ptr<MemoInfo>> MemoTables; // Of its fn memo definitions
+};
+
+struct tlang_session {
+    std::string Error;
+    Runtime *RT; // The opening thread's RUNTIME, reached from any thread
+    std::vector<std::unique_ptr<tlang_module>> Modules;
+};
+
+static thread_local tlang_session *Session = nullptr;   // The one this thread opened
+static thread_local std::vector<tlang_module *> Owners; // By SymbolID, the module whose definition is current
+
+// Runtime errors without a tlang_on_error() handler
+static void library_abort(const char *, void *) { abort(); }
+
+typedef std::vector<std::pair<SymbolID, std::unique_ptr<ProtoFn>>> ReplacedProtos;
+
+// Frees tables whose code is gone, and their symbols with them.
+static void free_memo_tables(std::vector<std::unique_ptr<MemoInfo>> &Tables) {
+    for (auto &Info : Tables) jit->undefineSymbol(Info->Symbol);
+    Tables.clear();
+}
+
+// HELPER FUNCTION -- new CONTEXT and BUILDER, once nothing made in the old
+// ones is left. Types and constants live as long as their context, so a
+// thread that keeps reopening sessions would otherwise keep all it ever made.
+static void recreate_context() {
+    ArrayStruct = nullptr;
+    MemoStruct = nullptr;
+    BUILDER.~IRBuilder();
+    CONTEXT.~LLVMContext();
+    new (&CONTEXT) llvm::LLVMContext();
+    new (&BUILDER) llvm::IRBuilder<>(CONTEXT);
+}
+
+// Reads every statement of the source into MODULE, false at the first
+// error. The prototypes they replace go to Replaced, to be put back then.
+static bool compile_source(tlang_module &M, ReplacedProtos &Replaced) {
+    for (get_next_token(); currToken != _EOF;) {
+        if (currToken == ';') {
+            get_next_token();
+            continue;
+        }
+        if (currToken == _IMPORT) {
+            auto Import = parse_import();
+            if (!Import) return false;
+            map_intrinsic(*Import);
+            if (!Import->codegen()) return false;
+            SymbolID Name = Import->getName();
+            Replaced.emplace_back(Name, std::move(symbol_slot(function_protos, Name)));
+            function_protos[Name] = std::move(Import);
+            continue;
+        }
+        if (currToken != _FN) {
+            log_error("Only definitions and imports can be compiled.");
+            return false;
+        }
+
+        auto Fn = parse_definition();
+        if (!Fn) return false;
+        SymbolID Name = Fn->getProto().getName();
+        for (auto &F : M.Functions)
+            if (F->Symbol == Name) {
+                log_error("Function defined twice in one module.");
+                return false;
+            }
+        Replaced.emplace_back(Name, std::move(symbol_slot(function_protos, Name)));
+        bool OK = Fn->codegen() && codegen_trampoline(Name);
+        AST.reset();
+        if (!OK) return false;
+
+        const ProtoFn &P = *function_protos[Name];
+        auto F = llvm::make_unique<tlang_function>();
+        F->Symbol = Name;
+        F->Name = SYMBOLS.name(Name).str();
+        F->RetType = P.getReturnType();
+        F->ArgTypes = P.getArgTypes().vec();
+        M.Functions.push_back(std::move(F));
+    }
+    return true;
+}
+
+extern "C" {
+
+tlang_session *tlang_open(int argc, const char *const *argv) {
+    if (Session) return nullptr;
+    initialize_native();
+    reset_options();
+    for (int i = 0; i != argc; i++) {
+        llvm::StringRef Arg = argv[i];
+        if (Arg.startswith("-time-") || Arg.startswith("-perf=") || !parse_option(Arg)) return nullptr;
+    }
+    std::string Err;
+    if (!load_vector_library(Err)) return nullptr;
+
+    HotThreshold = 0;        // Handles are native code
+    DeferDiagnostics = true; // Errors are kept for tlang_error()
+    start_jit(/*Lazy=*/false);
+    RUNTIME->Error = library_abort;
+    Session = new tlang_session;
+    Session->RT = RUNTIME.get();
+    return Session;
+}
+
+void tlang_close(tlang_session *S) {
+    while (!S->Modules.empty()) tlang_unload(S, S->Modules.back().get());
+    release_arrays(*S->RT);
+    jit.reset(); // Before the cache it writes to, and the runtime its code uses
+    RUNTIME.reset();
+    OBJCACHE.reset();
+    OPT.reset();
+    MODULE.reset();
+    function_protos.clear();
+    ModuleFunctions.clear();
+    NamedValues.clear();
+    MemoTables.clear();
+    MemoSerial = 0;
+    Owners.clear();
+    Functions.clear();
+    PendingTops.clear();
+    ScopeSlots.clear();
+    DefinitionLines.clear();
+    AST = ExprArena();
+    SYMBOLS = SymbolTable(); // After everything indexed by its ids
+    Counters = PipelineCounters();
+    DeferDiagnostics = false;
+    DeferredDiagnostics.clear();
+    recreate_context();
+    delete S;
+    Session = nullptr;
+}
+
+tlang_module *tlang_compile(tlang_session *S, const char *Source, ptrdiff_t Len) {
+    open_text(llvm::StringRef(Source, Len < 0 ? strlen(Source) : Len));
+    DeferredDiagnostics.clear();
+    auto M = llvm::make_unique<tlang_module>();
+    ReplacedProtos Replaced;
+    size_t FirstMemo = MemoTables.size();
+    bool OK = compile_source(*M, Replaced);
+    AST.reset();
+    close_text();
+    std::move(MemoTables.begin() + FirstMemo, MemoTables.end(), std::back_inserter(M->MemoTables));
+    MemoTables.erase(MemoTables.begin() + FirstMemo, MemoTables.end());
+
+    if (!OK) {
+        S->Error = llvm::StringRef(DeferredDiagnostics).rtrim().str();
+        for (auto I = Replaced.rbegin(); I != Replaced.rend(); ++I) function_protos[I->first] = std::move(I->second);
+        initialize_module(); // Drops whatever was generated
+        free_memo_tables(M->MemoTables);
+        return nullptr;
+    }
+    if (!M->Functions.empty()) M->Handle = add_module(std::move(MODULE));
+    initialize_module();
+    for (auto &F : M->Functions) { // Links the module
+        F->Address = (void *)(intptr_t)jit->findSymbolIn(M->Handle, F->Name).getAddress();
+        auto Tramp = jit->findSymbolIn(M->Handle, "__tier_" + F->Name);
+        F->Entry = (int64_t (*)(const Value *))(intptr_t)Tramp.getAddress();
+        symbol_slot(Owners, F->Symbol) = M.get();
+    }
+    S->Modules.push_back(std::move(M));
+    return S->Modules.back().get();
+}
+
+const char *tlang_error(const tlang_session *S) { return S->Error.c_str(); }
+
+void tlang_unload(tlang_session *S, tlang_module *M) {
+    if (!M->Functions.empty()) jit->removeModule(M->Handle);
+    for (auto &F : M->Functions) {
+        if (Owners[F->Symbol] != M) continue; // Redefined since
+        Owners[F->Symbol] = nullptr;
+        function_protos[F->Symbol] = nullptr;
+    }
+    free_memo_tables(M->MemoTables);
+    auto I = std::find_if(S->Modules.begin(), S->Modules.end(),
+                          [M](const std::unique_ptr<tlang_module> &Mod) { return Mod.get() == M; });
+    S->Modules.erase(I);
+}
+
+tlang_function *tlang_lookup(tlang_module *M, const char *Name) {
+    for (auto &F : M->Functions)
+        if (F->Name == Name) return F.get();
+    return nullptr;
+}
+
+tlang_type tlang_return_type(const tlang_function *F) { return (tlang_type)F->RetType; }
+
+int tlang_arity(const tlang_function *F) { return F->ArgTypes.size(); }
+
+tlang_type tlang_arg_type(const tlang_function *F, int i) { return (tlang_type)F->ArgTypes[i]; }
+
+void *tlang_address(const tlang_function *F) { return F->Address; }
+
+tlang_value tlang_call(const tlang_function *F, const tlang_value *Args) {
+    tlang_value R;
+    R.i = F->Entry(reinterpret_cast<const Value *>(Args));
+    return R;
+}
+
+void tlang_release_arrays(tlang_session *S) { release_arrays(*S->RT); }
+
+void tlang_on_error(tlang_session *S, void (*Handler)(const char *Message, void *User), void *User) {
+    S->RT->Error = Handler ? Handler : library_abort;
+    S->RT->User = User;
+}
+
+} // extern "C"
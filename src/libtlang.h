@@ -0,0 +1,112 @@
+/* Charles Timmerman - cttimm4427@ung.edu */
+
+#ifndef LIBTLANG_H
+#define LIBTLANG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* --- libtlang ---
+ * The compiler and JIT as a library, for hosts that call tlang functions
+ * without running tlang. Source text goes in, typed function handles come
+ * out, and each handle's native address can be called directly:
+ *
+ *     tlang_session *S = tlang_open(0, NULL);
+ *     tlang_module *M = tlang_compile(S, "fn f(x, n: int) x * n", -1);
+ *     if (!M) fprintf(stderr, "%s\n", tlang_error(S));
+ *     double (*f)(double, int64_t) = (double (*)(double, int64_t))tlang_address(tlang_lookup(M, "f"));
+ *     f(1.5, 4);
+ *     tlang_close(S);
+ *
+ * Nothing is written to stdout or stderr: compile errors are kept for
+ * tlang_error() and runtime errors go to tlang_on_error().
+ *
+ * A session is the compiler's state, kept by the thread that opened it:
+ * each thread can have one, and sessions on different threads compile in
+ * parallel without sharing anything. tlang_open, tlang_close, tlang_compile,
+ * tlang_error and tlang_unload are called on that thread. Everything else,
+ * the compiled functions included, can be called on any thread, several at
+ * once: a module is fully compiled by the time tlang_compile returns, and
+ * its code reports errors and hands its arrays to its session wherever it
+ * runs.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Values as the functions take and return them. Arrays are passed by
+ * pointer and read in place: a host array is never copied. */
+typedef enum tlang_type { TLANG_BOOL = 1, TLANG_INT = 2, TLANG_DOUBLE = 3, TLANG_ARRAY = 4 } tlang_type;
+
+#ifndef TLANG_ARRAY_DEFINED /* Also defined by tlangc headers */
+#define TLANG_ARRAY_DEFINED
+typedef struct tlang_array {
+    double *data;
+    int64_t len;
+} tlang_array;
+#endif
+
+typedef union tlang_value { /* bool in i as 0 or 1 */
+    double d;
+    int64_t i;
+    tlang_array *a;
+} tlang_value;
+
+typedef struct tlang_session tlang_session;
+typedef struct tlang_module tlang_module;
+typedef struct tlang_function tlang_function;
+
+/* Options as on the tlang command line (-O2, -mcpu=..., -fast-math,
+ * -cache-dir=...), except those that print or write reports. NULL on a bad
+ * option, or when this thread has a session open already. The object cache
+ * is off unless -cache-dir is given. */
+tlang_session *tlang_open(int argc, const char *const *argv);
+
+/* Unloads every module and frees the session. */
+void tlang_close(tlang_session *s);
+
+/* Compiles the fn definitions and imports in source (len bytes, or up to
+ * the terminating 0 when len is -1) into one module. Top-level expressions
+ * are errors. Definitions see those of earlier modules, and replace any of
+ * the same name for the modules compiled after. On an error nothing is
+ * kept and NULL is returned. */
+tlang_module *tlang_compile(tlang_session *s, const char *source, ptrdiff_t len);
+
+/* The errors of the last tlang_compile() that failed. */
+const char *tlang_error(const tlang_session *s);
+
+/* Frees m's code, its function handles and its memo tables. Its names are
+ * forgotten, unless a later module has defined them again. Modules that call
+ * into m must be unloaded first. */
+void tlang_unload(tlang_session *s, tlang_module *m);
+
+/* The function m defines as name, NULL if none. Valid until m is unloaded. */
+tlang_function *tlang_lookup(tlang_module *m, const char *name);
+
+tlang_type tlang_return_type(const tlang_function *f);
+int tlang_arity(const tlang_function *f);
+tlang_type tlang_arg_type(const tlang_function *f, int i);
+
+/* The function itself, to call with its C signature: double, int64_t, bool
+ * and tlang_array * for double, int, bool and array. */
+void *tlang_address(const tlang_function *f);
+
+/* Calls f with args (one per parameter, of its types) when the signature is
+ * only known at run time. */
+tlang_value tlang_call(const tlang_function *f, const tlang_value *args);
+
+/* Frees the arrays map and range have made in calls so far, on any thread,
+ * including any returned. No call that may still use one can be running. */
+void tlang_release_arrays(tlang_session *s);
+
+/* Array index and length errors call handler, on the thread that made the
+ * call, and it must not return (it may longjmp out). Without one the process
+ * aborts. Set it while no call is running. */
+void tlang_on_error(tlang_session *s, void (*handler)(const char *message, void *user), void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
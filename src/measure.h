@@ -0,0 +1,125 @@
+#ifndef MEASURE_H
+#define MEASURE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// --- Measurement ---
+// bench expr N compiles expr once, calls it once to get every function it
+// reaches compiled (the JIT compiles on first call), then calls it N times
+// timing each call with the monotonic clock, and N more counting cycles,
+// instructions, branch misses and cache misses in user space with
+// perf_event_open, enabled around each call alone. Where the counters cannot
+// be opened (no PMU in a VM, perf_event_paranoid) only the times are reported.
+
+struct HardwareCounter {
+    const char *Name;
+    uint64_t Config; // PERF_COUNT_HW_*
+    int Fd;
+    uint64_t Value;
+};
+
+static thread_local HardwareCounter HardwareCounters[] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES, -1, 0},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS, -1, 0},
+    {"branch-misses", PERF_COUNT_HW_BRANCH_MISSES, -1, 0},
+    {"cache-misses", PERF_COUNT_HW_CACHE_MISSES, -1, 0},
+};
+
+static thread_local bool CountersOpened = false;
+static thread_local int CounterErrno = 0; // Why the first counter failed to open
+
+// Opens each counter on its own, so one the CPU lacks does not take the rest
+static void open_counters() {
+    if (CountersOpened) return;
+    CountersOpened = true;
+    for (auto &C : HardwareCounters) {
+        perf_event_attr A;
+        memset(&A, 0, sizeof(A));
+        A.type = PERF_TYPE_HARDWARE;
+        A.size = sizeof(A);
+        A.config = C.Config;
+        A.disabled = 1;
+        A.exclude_kernel = 1;
+        A.exclude_hv = 1;
+        C.Fd = syscall(SYS_perf_event_open, &A, 0, -1, -1, 0); // This thread, any CPU
+        if (C.Fd < 0 && !CounterErrno) CounterErrno = errno;
+    }
+}
+
+static void reset_counters() {
+    for (auto &C : HardwareCounters)
+        if (C.Fd >= 0) ioctl(C.Fd, PERF_EVENT_IOC_RESET, 0);
+}
+
+// Counting resumes from where it stopped, so only the calls in between add up
+static void set_counters(bool On) {
+    for (auto &C : HardwareCounters)
+        if (C.Fd >= 0) ioctl(C.Fd, On ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static void read_counters() {
+    for (auto &C : HardwareCounters)
+        if (C.Fd >= 0 && read(C.Fd, &C.Value, sizeof(C.Value)) != sizeof(C.Value)) C.Value = 0;
+}
+
+// Nearest rank percentile of sorted samples
+static double percentile(const std::vector<double> &Sorted, double P) {
+    size_t Rank = (size_t)(P / 100 * Sorted.size() + 0.5);
+    return Sorted[std::min(Sorted.size() - 1, Rank ? Rank - 1 : 0)];
+}
+
+// Calls Fn Runs times after one warm-up call and reports on stderr. After
+// runs after every call, outside the measurement. The times and the counts
+// come from separate passes, so that neither includes the other's overhead.
+static double measure(double (*Fn)(), uint64_t Runs, void (*After)()) {
+    double Result = Fn();
+    After();
+
+    open_counters();
+    std::vector<double> Ns(Runs);
+    for (uint64_t i = 0; i != Runs; i++) {
+        auto Start = std::chrono::steady_clock::now();
+        Fn();
+        Ns[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - Start).count();
+        After();
+    }
+    if (std::any_of(std::begin(HardwareCounters), std::end(HardwareCounters),
+                    [](const HardwareCounter &C) { return C.Fd >= 0; })) {
+        reset_counters();
+        for (uint64_t i = 0; i != Runs; i++) {
+            set_counters(true);
+            Fn();
+            set_counters(false);
+            After();
+        }
+        read_counters();
+    }
+
+    std::sort(Ns.begin(), Ns.end());
+    fprintf(stderr, "bench: %llu runs, median %.3f us, p90 %.3f us, p99 %.3f us, min %.3f us, max %.3f us\n",
+            (unsigned long long)Runs, percentile(Ns, 50) / 1000, percentile(Ns, 90) / 1000, percentile(Ns, 99) / 1000,
+            Ns.front() / 1000, Ns.back() / 1000);
+    bool Any = false;
+    for (auto &C : HardwareCounters) {
+        if (C.Fd < 0) continue;
+        Any = true;
+        fprintf(stderr, "  %-14s %16llu  %14.1f per run\n", C.Name, (unsigned long long)C.Value,
+                (double)C.Value / Runs);
+    }
+    if (HardwareCounters[0].Fd >= 0 && HardwareCounters[1].Fd >= 0 && HardwareCounters[0].Value)
+        fprintf(stderr, "  %-14s %16.2f\n", "IPC", (double)HardwareCounters[1].Value / HardwareCounters[0].Value);
+    if (!Any) fprintf(stderr, "  hardware counters unavailable (%s), times only\n", strerror(CounterErrno));
+    return Result;
+}
+
+#endif
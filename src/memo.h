@@ -0,0 +1,245 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "tlang.h"
+
+// --- Memoization ---
+// fn memo name(...) caches the function's results by argument. Only pure
+// functions should be memoized, which in tlang means any function that does
+// not call an import with side effects. Each definition gets a table of
+// -memo-size entries (rounded up to a power of two), direct mapped by a hash
+// of the arguments' bits. -memo-evict=replace lets a new result take the slot
+// of an older one; -memo-evict=keep leaves the first result in place.
+//
+// The table lives in the runtime, and generated code reaches it through an
+// external symbol, __memo.<name>.<n>, that the session's JIT resolves when
+// the module is linked (defineSymbol), so the IR stays free of addresses and
+// cacheable. <n> numbers the session's tables: a redefinition gets a new one
+// while code not yet compiled may still refer to the old. The compiled function becomes
+// a lookup that calls the original body, moved to <name>.body, on a miss;
+// recursive calls go through the lookup too, which is what makes fib linear.
+// The interpreter uses the same table, so entries survive promotion. The
+// memo statement prints every table's hits and misses.
+//
+// Compiled functions may run on several threads at once (libtlang), so each
+// slot is a seqlock: its first word is a version, 0 while empty and odd while
+// a store is under way. A lookup reads the version, the keys and the result,
+// and hits only if the version was even and is unchanged after; a store
+// claims the slot by making the version odd, and gives up if another has.
+
+struct MemoTable {   // Read and written by generated code, keep in sync with memo_struct()
+    uint64_t Hits;    // Both counted atomically
+    uint64_t Misses;
+    uint64_t Mask;    // Entries - 1
+    int64_t *Slots;   // Per entry: version, argument bits..., result bits
+};
+
+struct MemoInfo {
+    MemoTable Table;  // First, so the symbol's address is the table's
+    std::string Symbol;
+    SymbolID Name;
+    unsigned NumArgs;
+    std::vector<int64_t> Storage;
+};
+
+static thread_local unsigned MemoSize = 4096;
+static thread_local bool MemoKeep = false;                       // -memo-evict=keep
+static thread_local std::vector<std::unique_ptr<MemoInfo>> MemoTables; // Every definition's, old ones included, until libtlang takes them
+static thread_local bool MemoTablesInModule = false;             // AOT: each table is a global of its module
+static thread_local unsigned MemoSerial = 0;                     // Tables made this session, names their symbols
+
+// Same mix as the generated lookup, so both tiers find the same slot
+static uint64_t memo_hash(const int64_t *Keys, unsigned N) {
+    uint64_t H = 0;
+    for (unsigned i = 0; i != N; i++) H = (H ^ (uint64_t)Keys[i]) * 0x9E3779B97F4A7C15ull;
+    return H ^ (H >> 32);
+}
+
+// Gives a memo definition its table. Arrays are freed after every top-level
+// expression, so they can be neither keys nor results.
+static bool attach_memo(ProtoFn &P) {
+    if (!P.isMemo()) return true;
+    bool Scalar = P.getReturnType() != T_ARRAY;
+    for (ValueType T : P.getArgTypes()) Scalar &= T != T_ARRAY;
+    if (!Scalar) {
+        log_error("memo functions take and return scalars.");
+        return false;
+    }
+
+    unsigned Entries = 1;
+    while (Entries < MemoSize) Entries <<= 1;
+    auto Info = llvm::make_unique<MemoInfo>();
+    Info->Name = P.getName();
+    Info->NumArgs = P.getArgs().size();
+    Info->Symbol = "__memo." + SYMBOLS.name(P.getName()).str() + "." + std::to_string(MemoSerial++);
+    Info->Storage.assign((size_t)Entries * (Info->NumArgs + 2), 0);
+    Info->Table = MemoTable{0, 0, Entries - 1, Info->Storage.data()};
+    jit->defineSymbol(Info->Symbol, &Info->Table);
+    P.setMemoTable(Info.get());
+    MemoTables.push_back(std::move(Info));
+    return true;
+}
+
+// Interpreter side of the lookup: true and the cached result on a hit
+static bool memo_lookup(MemoInfo &M, const Value *Args, Value &Result) {
+    const int64_t *Keys = (const int64_t *)Args;
+    int64_t *Slot = M.Table.Slots + (memo_hash(Keys, M.NumArgs) & M.Table.Mask) * (M.NumArgs + 2);
+    int64_t Version = __atomic_load_n(Slot, __ATOMIC_ACQUIRE);
+    bool Hit = Version && !(Version & 1);
+    for (unsigned i = 0; i != M.NumArgs; i++) Hit &= __atomic_load_n(Slot + i + 1, __ATOMIC_RELAXED) == Keys[i];
+    int64_t Cached = __atomic_load_n(Slot + M.NumArgs + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (Hit && __atomic_load_n(Slot, __ATOMIC_RELAXED) == Version) {
+        __atomic_fetch_add(&M.Table.Hits, 1, __ATOMIC_RELAXED);
+        Result.I = Cached;
+        return true;
+    }
+    __atomic_fetch_add(&M.Table.Misses, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+static void memo_store(MemoInfo &M, const Value *Args, Value Result) {
+    const int64_t *Keys = (const int64_t *)Args;
+    int64_t *Slot = M.Table.Slots + (memo_hash(Keys, M.NumArgs) & M.Table.Mask) * (M.NumArgs + 2);
+    int64_t Version = __atomic_load_n(Slot, __ATOMIC_RELAXED);
+    if ((Version & 1) || (MemoKeep && Version)) return;
+    if (!__atomic_compare_exchange_n(Slot, &Version, Version + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (unsigned i = 0; i != M.NumArgs; i++) __atomic_store_n(Slot + i + 1, Keys[i], __ATOMIC_RELAXED);
+    __atomic_store_n(Slot + M.NumArgs + 1, Result.I, __ATOMIC_RELAXED);
+    __atomic_store_n(Slot, Version + 2, __ATOMIC_RELEASE);
+}
+
+static void print_memo_stats() {
+    for (auto &P : function_protos) {
+        if (!P || !P->getMemoTable()) continue;
+        const MemoTable &T = P->getMemoTable()->Table;
+        fprintf(stderr, "memo %s: %llu entries, %llu hits, %llu misses\n", SYMBOLS.name(P->getName()).str().c_str(),
+                (unsigned long long)T.Mask + 1, (unsigned long long)T.Hits, (unsigned long long)T.Misses);
+    }
+}
+
+static thread_local llvm::StructType *MemoStruct = nullptr; // In CONTEXT, made on first use
+
+// HELPER FUNCTION -- %memotable, laid out as struct MemoTable
+static llvm::StructType *memo_struct() {
+    if (!MemoStruct) {
+        llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+        MemoStruct = llvm::StructType::create(CONTEXT, {I64, I64, I64, I64->getPointerTo()}, "memotable");
+    }
+    return MemoStruct;
+}
+
+// HELPER FUNCTION -- Info's table as a zeroed global of M, for AOT objects
+static llvm::Constant *memo_global(llvm::Module &M, const MemoInfo &Info) {
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    llvm::ArrayType *SlotsType = llvm::ArrayType::get(I64, (Info.Table.Mask + 1) * (Info.NumArgs + 2));
+    auto *Slots = new llvm::GlobalVariable(M, SlotsType, false, llvm::GlobalValue::InternalLinkage,
+                                           llvm::ConstantAggregateZero::get(SlotsType), Info.Symbol + ".slots");
+    llvm::Constant *Zero = llvm::ConstantInt::get(I64, 0);
+    llvm::Constant *Init = llvm::ConstantStruct::get(
+        memo_struct(), {Zero, Zero, llvm::ConstantInt::get(I64, Info.Table.Mask),
+                        llvm::ConstantExpr::getBitCast(Slots, I64->getPointerTo())});
+    return new llvm::GlobalVariable(M, memo_struct(), false, llvm::GlobalValue::InternalLinkage, Init, Info.Symbol);
+}
+
+// Moves F's body to <name>.body and makes F look the arguments up in P's
+// table first. Returns the body, still to be verified and optimized.
+static llvm::Function *memoize(llvm::Function &F, const ProtoFn &P) {
+    llvm::Module &M = *F.getParent();
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    MemoInfo &Info = *P.getMemoTable();
+    unsigned N = Info.NumArgs;
+
+    llvm::Function *Body = llvm::Function::Create(F.getFunctionType(), llvm::Function::InternalLinkage,
+                                                  F.getName() + ".body", &M);
+    Body->copyAttributesFrom(&F);
+    Body->getBasicBlockList().splice(Body->begin(), F.getBasicBlockList());
+    auto BodyArg = Body->arg_begin();
+    for (auto &Arg : F.args()) {
+        BodyArg->setName(Arg.getName());
+        Arg.replaceAllUsesWith(&*BodyArg++);
+    }
+
+    BUILDER.SetInsertPoint(llvm::BasicBlock::Create(CONTEXT, "entry", &F));
+    llvm::Value *Table = MemoTablesInModule ? memo_global(M, Info) : M.getOrInsertGlobal(Info.Symbol, memo_struct());
+    llvm::SmallVector<llvm::Value *, 8> Args, Keys;
+    llvm::Value *H = llvm::ConstantInt::get(I64, 0);
+    for (auto &Arg : F.args()) {
+        Args.push_back(&Arg);
+        Keys.push_back(to_slot(&Arg, P.getArgTypes()[Keys.size()]));
+        H = BUILDER.CreateMul(BUILDER.CreateXor(H, Keys.back()), llvm::ConstantInt::get(I64, 0x9E3779B97F4A7C15ull));
+    }
+    H = BUILDER.CreateXor(H, BUILDER.CreateLShr(H, 32), "HASH");
+
+    llvm::Value *Mask = BUILDER.CreateLoad(BUILDER.CreateStructGEP(memo_struct(), Table, 2), "MASK");
+    llvm::Value *Slots = BUILDER.CreateLoad(BUILDER.CreateStructGEP(memo_struct(), Table, 3), "SLOTS");
+    llvm::Value *Slot = BUILDER.CreateInBoundsGEP(
+        Slots, BUILDER.CreateMul(BUILDER.CreateAnd(H, Mask), llvm::ConstantInt::get(I64, N + 2)), "SLOT");
+    auto Field = [&](unsigned i) { return BUILDER.CreateConstInBoundsGEP1_32(I64, Slot, i); };
+    auto Load = [&](llvm::Value *Ptr, llvm::AtomicOrdering Order) {
+        llvm::LoadInst *L = BUILDER.CreateLoad(Ptr);
+        L->setAlignment(8);
+        L->setAtomic(Order);
+        return L;
+    };
+    auto Store = [&](llvm::Value *V, llvm::Value *Ptr, llvm::AtomicOrdering Order) {
+        llvm::StoreInst *S = BUILDER.CreateStore(V, Ptr);
+        S->setAlignment(8);
+        S->setAtomic(Order);
+    };
+    auto Count = [&](unsigned Idx) {
+        BUILDER.CreateAtomicRMW(llvm::AtomicRMWInst::Add, BUILDER.CreateStructGEP(memo_struct(), Table, Idx),
+                                llvm::ConstantInt::get(I64, 1), llvm::AtomicOrdering::Monotonic);
+    };
+    llvm::Value *Zero = llvm::ConstantInt::get(I64, 0), *One = llvm::ConstantInt::get(I64, 1);
+
+    // Seqlock read: the version, even and nonzero, must not change around the keys and result
+    llvm::Value *Version = Load(Field(0), llvm::AtomicOrdering::Acquire);
+    llvm::Value *Hit = BUILDER.CreateAnd(BUILDER.CreateICmpNE(Version, Zero),
+                                         BUILDER.CreateICmpEQ(BUILDER.CreateAnd(Version, One), Zero));
+    for (unsigned i = 0; i != N; i++)
+        Hit = BUILDER.CreateAnd(Hit,
+                                BUILDER.CreateICmpEQ(Load(Field(i + 1), llvm::AtomicOrdering::Monotonic), Keys[i]));
+    llvm::Value *Cached = Load(Field(N + 1), llvm::AtomicOrdering::Monotonic);
+    BUILDER.CreateFence(llvm::AtomicOrdering::Acquire);
+    Hit = BUILDER.CreateAnd(Hit, BUILDER.CreateICmpEQ(Load(Field(0), llvm::AtomicOrdering::Monotonic), Version));
+    llvm::BasicBlock *hitblock = llvm::BasicBlock::Create(CONTEXT, "MEMOHIT", &F);
+    llvm::BasicBlock *missblock = llvm::BasicBlock::Create(CONTEXT, "MEMOMISS", &F);
+    BUILDER.CreateCondBr(Hit, hitblock, missblock);
+
+    BUILDER.SetInsertPoint(hitblock);
+    Count(0);
+    BUILDER.CreateRet(from_slot(Cached, P.getReturnType()));
+
+    // On a miss, store unless another store is under way, or, with -memo-evict=keep,
+    // recursive calls have filled the slot meanwhile
+    BUILDER.SetInsertPoint(missblock);
+    Count(1);
+    llvm::Value *R = BUILDER.CreateCall(Body, Args, "retval");
+    llvm::BasicBlock *claimblock = llvm::BasicBlock::Create(CONTEXT, "MEMOCLAIM", &F);
+    llvm::BasicBlock *storeblock = llvm::BasicBlock::Create(CONTEXT, "MEMOSTORE", &F);
+    llvm::BasicBlock *doneblock = llvm::BasicBlock::Create(CONTEXT, "MEMODONE", &F);
+    Version = Load(Field(0), llvm::AtomicOrdering::Monotonic);
+    llvm::Value *Busy = BUILDER.CreateICmpNE(BUILDER.CreateAnd(Version, One), Zero);
+    if (MemoKeep) Busy = BUILDER.CreateOr(Busy, BUILDER.CreateICmpNE(Version, Zero));
+    BUILDER.CreateCondBr(Busy, doneblock, claimblock);
+
+    BUILDER.SetInsertPoint(claimblock);
+    llvm::Value *Claim = BUILDER.CreateAtomicCmpXchg(Field(0), Version, BUILDER.CreateAdd(Version, One),
+                                                     llvm::AtomicOrdering::Monotonic, llvm::AtomicOrdering::Monotonic);
+    BUILDER.CreateCondBr(BUILDER.CreateExtractValue(Claim, 1), storeblock, doneblock);
+
+    BUILDER.SetInsertPoint(storeblock);
+    BUILDER.CreateFence(llvm::AtomicOrdering::Release);
+    for (unsigned i = 0; i != N; i++) Store(Keys[i], Field(i + 1), llvm::AtomicOrdering::Monotonic);
+    Store(to_slot(R, P.getReturnType()), Field(N + 1), llvm::AtomicOrdering::Monotonic);
+    Store(BUILDER.CreateAdd(Version, llvm::ConstantInt::get(I64, 2)), Field(0), llvm::AtomicOrdering::Release);
+    BUILDER.CreateBr(doneblock);
+
+    BUILDER.SetInsertPoint(doneblock);
+    BUILDER.CreateRet(R);
+    return Body;
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef MVERSION_H
+#define MVERSION_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <string>
+#include <vector>
+
+// --- Function multiversioning ---
+// -mversions=avx2+fma,avx512f clones every function once per listed version
+// (a '+' separated feature set) besides the default one built for -mcpu,
+// and turns the original into a dispatcher. The first call reads the CPU
+// model libgcc/compiler-rt fill in (__cpu_model, the same data behind
+// __builtin_cpu_supports), stores the best clone in a per-function pointer
+// and jumps to it; every later call is one indirect jump. Versions are listed
+// from least to most capable and the last one the CPU supports wins.
+//
+// Dispatch at first call works the same in the JIT, in a cached object moved
+// to another machine and in an AOT object, without ifunc support from the
+// loader. Only x86 is supported; elsewhere modules are left alone.
+
+struct CodeVersion {
+    std::string Name;     // Clone suffix, "avx2.fma"
+    std::string Features; // target-features, "+avx2,+fma"
+    uint32_t Mask;        // __cpu_model.__cpu_features[0] bits that must be set
+};
+
+static thread_local std::vector<CodeVersion> CodeVersions;
+
+// Bit numbers of libgcc's enum processor_features
+static int cpu_feature_bit(llvm::StringRef Feature) {
+    return llvm::StringSwitch<int>(Feature)
+        .Case("popcnt", 2)
+        .Case("sse4.1", 7)
+        .Case("sse4.2", 8)
+        .Case("avx", 9)
+        .Case("avx2", 10)
+        .Case("fma", 14)
+        .Case("avx512f", 15)
+        .Case("bmi", 16)
+        .Case("bmi2", 17)
+        .Default(-1);
+}
+
+// Parses the -mversions list, false on an unknown feature
+static bool parse_versions(llvm::StringRef List) {
+    llvm::SmallVector<llvm::StringRef, 4> Versions;
+    List.split(Versions, ',', -1, false);
+    for (llvm::StringRef V : Versions) {
+        CodeVersion CV{"", "", 0};
+        llvm::SmallVector<llvm::StringRef, 4> Features;
+        V.split(Features, '+', -1, false);
+        for (llvm::StringRef F : Features) {
+            int Bit = cpu_feature_bit(F);
+            if (Bit < 0) return false;
+            CV.Name += (CV.Name.empty() ? "" : ".") + F.str();
+            CV.Features += (CV.Features.empty() ? "+" : ",+") + F.str();
+            CV.Mask |= 1u << Bit;
+        }
+        CodeVersions.push_back(CV);
+    }
+    return true;
+}
+
+// Copy of F named F.<Suffix>, with its self calls bound to the copy
+static llvm::Function *clone_version(llvm::Function &F, const std::string &Suffix) {
+    llvm::Function *Clone = llvm::Function::Create(F.getFunctionType(), llvm::Function::InternalLinkage,
+                                                   F.getName() + "." + Suffix, F.getParent());
+    llvm::ValueToValueMapTy VMap;
+    auto CloneArg = Clone->arg_begin();
+    for (auto &Arg : F.args()) {
+        CloneArg->setName(Arg.getName());
+        VMap[&Arg] = &*CloneArg++;
+    }
+    VMap[&F] = Clone;
+    llvm::SmallVector<llvm::ReturnInst *, 4> Returns;
+    llvm::CloneFunctionInto(Clone, &F, VMap, /*ModuleLevelChanges=*/false, Returns);
+    return Clone;
+}
+
+static void multiversion_function(llvm::Function &F) {
+    llvm::Module &M = *F.getParent();
+    llvm::LLVMContext &C = M.getContext();
+    llvm::Type *I32 = llvm::Type::getInt32Ty(C);
+
+    llvm::Function *Default = clone_version(F, "default");
+    std::vector<llvm::Function *> Clones;
+    for (auto &V : CodeVersions) {
+        llvm::Function *Clone = clone_version(F, V.Name);
+        Clone->addFnAttr("target-features", V.Features);
+        Clones.push_back(Clone);
+    }
+
+    // struct __processor_model { unsigned vendor, type, subtype; unsigned features[1]; }
+    llvm::StructType *Model = M.getTypeByName("struct.__processor_model");
+    if (!Model)
+        Model = llvm::StructType::create(C, {I32, I32, I32, llvm::ArrayType::get(I32, 1)},
+                                         "struct.__processor_model");
+    llvm::Constant *CPUModel = M.getOrInsertGlobal("__cpu_model", Model);
+    llvm::Constant *CPUInit = M.getOrInsertFunction("__cpu_indicator_init", llvm::Type::getVoidTy(C), nullptr);
+
+    // Resolver, the pointer's initial target
+    llvm::Function *Resolve = llvm::Function::Create(F.getFunctionType(), llvm::Function::InternalLinkage,
+                                                     F.getName() + ".resolve", &M);
+    auto *Ptr = new llvm::GlobalVariable(M, F.getType(), false, llvm::GlobalValue::InternalLinkage,
+                                         Resolve, F.getName() + ".ptr");
+
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(C, "entry", Resolve));
+    llvm::SmallVector<llvm::Value *, 8> Args;
+    for (auto &Arg : Resolve->args()) Args.push_back(&Arg);
+    B.CreateCall(CPUInit, {}); // Idempotent, normally already run as a constructor
+    llvm::Value *FeaturesPtr = B.CreateInBoundsGEP(Model, CPUModel, {B.getInt32(0), B.getInt32(3), B.getInt32(0)});
+    llvm::Value *Features = B.CreateLoad(FeaturesPtr, "features");
+
+    // Later (more capable) versions override earlier ones
+    llvm::Value *Best = Default;
+    for (size_t i = 0; i < Clones.size(); i++) {
+        llvm::Value *Mask = llvm::ConstantInt::get(I32, CodeVersions[i].Mask);
+        llvm::Value *Has = B.CreateICmpEQ(B.CreateAnd(Features, Mask), Mask);
+        Best = B.CreateSelect(Has, Clones[i], Best);
+    }
+    // Threads may race to the first call: the pointer is read and written
+    // atomically, and whichever store lands, every one picks the same version.
+    unsigned PtrAlign = M.getDataLayout().getPointerABIAlignment();
+    llvm::StoreInst *Store = B.CreateStore(Best, Ptr);
+    Store->setAlignment(PtrAlign);
+    Store->setAtomic(llvm::AtomicOrdering::Unordered);
+    B.CreateRet(B.CreateCall(Best, Args));
+
+    // The original becomes the dispatcher
+    F.deleteBody();
+    B.SetInsertPoint(llvm::BasicBlock::Create(C, "entry", &F));
+    Args.clear();
+    for (auto &Arg : F.args()) Args.push_back(&Arg);
+    llvm::LoadInst *Version = B.CreateLoad(Ptr, "version");
+    Version->setAlignment(PtrAlign);
+    Version->setAtomic(llvm::AtomicOrdering::Unordered);
+    llvm::CallInst *Call = B.CreateCall(Version, Args);
+    Call->setTailCall();
+    B.CreateRet(Call);
+}
+
+// Versions every function defined in M except the compiler's own entry points
+static void multiversion_module(llvm::Module &M) {
+    if (CodeVersions.empty()) return;
+    llvm::Triple T(M.getTargetTriple());
+    if (T.getArch() != llvm::Triple::x86 && T.getArch() != llvm::Triple::x86_64) return;
+
+    std::vector<llvm::Function *> Targets;
+    for (auto &F : M)
+        if (!F.isDeclaration() && !F.getName().startswith("__"))
+            Targets.push_back(&F);
+    for (llvm::Function *F : Targets) multiversion_function(*F);
+}
+
+#endif
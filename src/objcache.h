@@ -0,0 +1,137 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include <utime.h>
+
+// --- Object cache ---
+// Persistent cache of JIT compiled objects. IRCompileLayer asks it before
+// running the compiler; an entry is named by the MD5 of the optimized module
+// IR together with the triple, CPU, features and codegen level of the target
+// machine, so a hit is an object built from the same IR for the same CPU.
+// Hits refresh the entry's modification time, and once the directory grows
+// past its byte budget the least recently used entries are removed.
+
+class DiskObjectCache : public llvm::ObjectCache {
+    std::string Dir;
+    std::string TargetKey;
+    uint64_t MaxBytes;
+    uint64_t TotalBytes = 0;
+    unsigned Hits = 0, Misses = 0;
+
+    // A miss in getObject() is followed by notifyObjectCompiled() for the
+    // same module, so the path is not hashed twice.
+    const llvm::Module *LastModule = nullptr;
+    std::string LastPath;
+
+    std::string entry_path(const llvm::Module *M) {
+        std::string IR;
+        llvm::raw_string_ostream IRStream(IR);
+        M->print(IRStream, nullptr);
+        IRStream.flush();
+
+        llvm::MD5 Hash;
+        Hash.update(TargetKey);
+        Hash.update(IR);
+        llvm::MD5::MD5Result Result;
+        Hash.final(Result);
+        llvm::SmallString<32> Hex;
+        llvm::MD5::stringifyResult(Result, Hex);
+
+        LastModule = M;
+        LastPath = (Dir + "/" + Hex + ".o").str();
+        return LastPath;
+    }
+
+    // Returns (modification time, size) for every entry in the directory
+    std::vector<std::pair<std::pair<llvm::sys::TimePoint<>, uint64_t>, std::string>> scan() {
+        std::vector<std::pair<std::pair<llvm::sys::TimePoint<>, uint64_t>, std::string>> Entries;
+        std::error_code EC;
+        for (llvm::sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC; I.increment(EC)) {
+            if (llvm::sys::path::extension(I->path()) != ".o") continue;
+            llvm::sys::fs::file_status Status;
+            if (llvm::sys::fs::status(I->path(), Status)) continue;
+            Entries.push_back(std::make_pair(
+                std::make_pair(Status.getLastModificationTime(), Status.getSize()), I->path()));
+        }
+        return Entries;
+    }
+
+    void evict() {
+        auto Entries = scan();
+        std::sort(Entries.begin(), Entries.end()); // Oldest first
+        TotalBytes = 0;
+        for (auto &E : Entries) TotalBytes += E.first.second;
+
+        // Trim to 3/4 of the budget so the next few misses don't rescan
+        for (auto &E : Entries) {
+            if (TotalBytes <= MaxBytes / 4 * 3) break;
+            if (!llvm::sys::fs::remove(E.second)) TotalBytes -= E.first.second;
+        }
+    }
+
+public:
+    DiskObjectCache(const std::string &Dir, uint64_t MaxBytes, const llvm::TargetMachine &TM)
+        : Dir(Dir), MaxBytes(MaxBytes) {
+        TargetKey = TM.getTargetTriple().str() + "|" + TM.getTargetCPU().str() + "|" +
+                    TM.getTargetFeatureString().str() + "|" + std::to_string((int)TM.getOptLevel());
+        llvm::sys::fs::create_directories(Dir);
+        for (auto &E : scan()) TotalBytes += E.first.second;
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override {
+        std::string Path = entry_path(M); // Always rehashed, module addresses get reused
+        auto Buf = llvm::MemoryBuffer::getFile(Path, -1, /*RequiresNullTerminator=*/false);
+        if (!Buf) {
+            ++Misses;
+            return nullptr;
+        }
+        ++Hits;
+        utime(Path.c_str(), nullptr); // Most recently used
+        return std::move(*Buf);
+    }
+
+    void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override {
+        std::string Path = M == LastModule ? LastPath : entry_path(M);
+
+        // Write to a temporary and rename, so a concurrent tlang never maps
+        // a half written object.
+        int FD;
+        llvm::SmallString<128> TmpPath;
+        if (llvm::sys::fs::createUniqueFile(Dir + "/tmp-%%%%%%%%", FD, TmpPath)) return;
+        {
+            llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+            Out << Obj.getBuffer();
+        }
+        // An entry of the same hash, written by another tlang since the
+        // lookup missed, is replaced and no longer counts
+        uint64_t Replaced = 0;
+        llvm::sys::fs::file_status Status;
+        if (!llvm::sys::fs::status(Path, Status) && llvm::sys::fs::exists(Status)) Replaced = Status.getSize();
+        if (llvm::sys::fs::rename(TmpPath, Path)) {
+            llvm::sys::fs::remove(TmpPath);
+            return;
+        }
+
+        TotalBytes += Obj.getBufferSize();
+        TotalBytes -= std::min(TotalBytes, Replaced);
+        if (TotalBytes > MaxBytes) evict();
+    }
+
+    unsigned hits() const { return Hits; }
+    unsigned misses() const { return Misses; }
+};
+
+#endif
@@ -4,13 +4,30 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-#include "tlang.h"
+#include "tier.h"
+#include "aot.h"
 
 // --- Globals ---
 
-static double NumVal;
-static int currToken;
-static std::string IdentStr;
+static thread_local Value NumVal;
+static thread_local ValueType NumType;
+static thread_local int currToken;
+static thread_local llvm::StringRef IdentStr; // Slice of the source buffer, valid while it is open
+static thread_local SymbolID IdentSym;        // IdentStr interned
+
+// --- Source buffer ---
+// The lexer scans a contiguous buffer instead of pulling characters through
+// getchar(). A script file is mapped whole; interactive input is read one
+// line at a time and every line is kept, so identifier slices never dangle.
+struct SourceBuffer {
+    std::unique_ptr<llvm::MemoryBuffer> File;
+    std::vector<std::unique_ptr<char[]>> Lines;
+    std::unique_ptr<char[]> Text; // open_text's copy, until close_text
+    const char *Cur = nullptr;
+    const char *End = nullptr;
+    bool Interactive = false;
+};
+static thread_local SourceBuffer SRC;
 
 // --- Tokens ---
 enum Token {
@@ -27,35 +44,52 @@ enum Token {
     _ELIF = -11,
     _FOR = -12, 
     _OPEN = -13, // {
-    _CLOSE = -14 // }
+    _CLOSE = -14, // }
+    _LET = -15,
+    _MEMO = -16,
+    _STATS = -17,
+    _BENCH = -18
 };
 
 // --- Lexer functions --- 
 
+static bool open_source(const char *Path);
+static void open_stdin();
+static void open_text(llvm::StringRef Text);
+static void close_text();
+static bool refill_source();
 static int get_token();
 static int get_next_token();
 static int get_token_precedence();
 
 // --- Parser Prototypes ---
 
-static std::unique_ptr<Expression> parse_expression();
-static std::unique_ptr<Expression> parse_numexpr();
-static std::unique_ptr<Expression> parse_paren();
-static std::unique_ptr<Expression> parse_idexp();
-static std::unique_ptr<Expression> parse_primary();
-static std::unique_ptr<Expression> parse_rbinop();
-static std::unique_ptr<Expression> parse_expression();
+static ExprRef parse_expression();
+static ExprRef parse_numexpr();
+static ExprRef parse_paren();
+static ExprRef parse_idexp();
+static ExprRef parse_primary();
+static ExprRef parse_rbinop(int current_prec, ExprRef leftSide);
+static ExprRef parse_expression();
 static std::unique_ptr<ProtoFn> parse_prototype();
+static std::unique_ptr<ProtoFn> parse_params(SymbolID fnName, bool Fast);
 static std::unique_ptr<FnExpression> parse_definition();
 static std::unique_ptr<ProtoFn> parse_import();
-static std::unique_ptr<FnExpression> parse_top_expr();
-static std::unique_ptr<Expression> parse_if();
+static std::unique_ptr<FnExpression> parse_top_expr(SymbolID Entry);
+static ExprRef parse_if();
+static ExprRef parse_for();
+static ExprRef parse_block();
+static ExprRef parse_let();
 
 // --- Top level parsing --- 
 
 static void handle_definition();
 static void handle_import();
 static void handle_top();
+static void flush_top();
+static void handle_memo();
+static void handle_stats();
+static void handle_bench();
 
 
 
@@ -63,56 +97,198 @@ static void handle_top();
 // -- Lexer -- //
 //             //
 
+// Maps a script file as the source buffer ( tlang file.tl )
+static bool open_source(const char *Path) {
+    auto Buf = llvm::MemoryBuffer::getFile(Path, -1, /*RequiresNullTerminator=*/false);
+    if (!Buf) {
+        fprintf(stderr, "tlang: cannot open %s: %s\n", Path, Buf.getError().message().c_str());
+        return false;
+    }
+    SRC.File = std::move(*Buf);
+    SRC.Cur = SRC.File->getBufferStart();
+    SRC.End = SRC.File->getBufferEnd();
+    SRC.Interactive = false;
+    return true;
+}
+
+// Piped input is read in one go, a terminal is read line by line
+static void open_stdin() {
+    if (!isatty(fileno(stdin))) {
+        if (auto Buf = llvm::MemoryBuffer::getSTDIN()) {
+            SRC.File = std::move(*Buf);
+            SRC.Cur = SRC.File->getBufferStart();
+            SRC.End = SRC.File->getBufferEnd();
+            return;
+        }
+    }
+    SRC.Interactive = true;
+}
+
+// Source handed over as a string (libtlang), copied for as long as it is
+// parsed. Names are interned, so nothing needs the text after.
+static void open_text(llvm::StringRef Text) {
+    SRC.Text.reset(new char[Text.size()]);
+    memcpy(SRC.Text.get(), Text.data(), Text.size());
+    SRC.Cur = SRC.Text.get();
+    SRC.End = SRC.Cur + Text.size();
+    SRC.Interactive = false;
+}
+
+// Frees open_text's copy once its statements are compiled
+static void close_text() {
+    SRC.Text.reset();
+    SRC.Cur = SRC.End = nullptr;
+    IdentStr = llvm::StringRef();
+}
+
+// HELPER FUNCTION -- pulls the next interactive line, false at end of input
+static bool refill_source() {
+    if (!SRC.Interactive) return false;
+
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, stdin);
+    if (len <= 0) {
+        free(line);
+        return false;
+    }
+    std::unique_ptr<char[]> Copy(new char[len]);
+    memcpy(Copy.get(), line, len);
+    free(line);
+
+    SRC.Cur = Copy.get();
+    SRC.End = SRC.Cur + len;
+    SRC.Lines.push_back(std::move(Copy));
+    return true;
+}
+
+// HELPER FUNCTION -- keywords are matched by length first, no string building
+static int keyword_token(llvm::StringRef Word) {
+    switch (Word.size()) {
+        case 2:
+            if (Word[0] == 'f' && Word[1] == 'n') return _FN;
+            if (Word[0] == 'i' && Word[1] == 'f') return _IF;
+            break;
+        case 3:
+            if (Word == "for") return _FOR;
+            if (Word == "let") return _LET;
+            break;
+        case 4:
+            if (Word == "exit") return _EXIT;
+            if (Word == "elif") return _ELIF;
+            if (Word == "else") return _ELSE;
+            if (Word == "memo") return _MEMO;
+            break;
+        case 5:
+            if (Word == "stats") return _STATS;
+            if (Word == "bench") return _BENCH;
+            break;
+        case 6:
+            if (Word == "import") return _IMPORT;
+            break;
+    }
+    return _IDENT;
+}
+
+// HELPER FUNCTION -- line of the last token read, for the profiler's line
+// records (perf.h). Only counted when asked for.
+static unsigned current_line() {
+    if (SRC.Interactive) return SRC.Lines.size();
+    static thread_local const char *Counted = nullptr;
+    static thread_local unsigned Line = 1;
+    if (!Counted) Counted = SRC.File->getBufferStart();
+    Line += std::count(Counted, SRC.Cur, '\n');
+    Counted = SRC.Cur;
+    return Line;
+}
+
+// HELPER FUNCTION -- converts a scanned number
+// Up to 15 significant digits and 22 fraction digits both the mantissa and the
+// power of ten are exact doubles, so one division is correctly rounded.
+// Anything longer goes through strtod.
+static double scan_number(const char *Start, const char *End, uint64_t Mantissa, int Digits, int Frac) {
+    static const double Pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    if (Digits <= 15 && Frac <= 22)
+        return (double)Mantissa / Pow10[Frac];
+
+    std::string NumStr(Start, End);
+    return strtod(NumStr.c_str(), 0);
+}
+
 static int get_token() {
+    StageScope Timing(STAGE_LEX);
+    ++Counters.Tokens;
+    int c;
+    while (1) {
+        if (SRC.Cur == SRC.End && !refill_source()) return _EOF;
+        c = (unsigned char)*SRC.Cur;
+
+        if (isspace(c)) {
+            ++SRC.Cur;
+            continue;
+        }
+        if (c == '#') { // Until end of line
+            const char *nl = (const char *)memchr(SRC.Cur, '\n', SRC.End - SRC.Cur);
+            SRC.Cur = nl ? nl : SRC.End;
+            continue;
+        }
+        break;
+    }
 
-    static int last_char = ' ';
+    const char *start = SRC.Cur;
+    const char *end = SRC.End;
 
-    while(isspace(last_char))
-        last_char = getchar();
-    
     // Ensure first character is alpha and following is alphanum
-    if (isalpha(last_char)) {
-        IdentStr = last_char; // Global IdentStr
-        while(isalnum((last_char = getchar())))
-            IdentStr += last_char;
-        if (IdentStr == "fn") return _FN;
-        if (IdentStr == "import") return _IMPORT;
-        if (IdentStr == "exit") return _EXIT;
-        if (IdentStr == "if") return _IF;
-        if (IdentStr == "elif") return _ELIF;
-        if (IdentStr == "else") return _ELSE;
-        if (IdentStr == "for") return _FOR;
-        return _IDENT;
+    if (isalpha(c)) {
+        const char *p = start + 1;
+        while (p != end && isalnum((unsigned char)*p)) ++p;
+        SRC.Cur = p;
+        IdentStr = llvm::StringRef(start, p - start); // Global IdentStr
+        int Tok = keyword_token(IdentStr);
+        if (Tok == _IDENT) IdentSym = SYMBOLS.intern(IdentStr);
+        return Tok;
     }
     
-    // Numbers are all Doubles
-    if (isdigit(last_char)) {
-        std::string NumStr;
-        do {
-            NumStr += last_char;
-            last_char = getchar();
-        } while (isdigit(last_char));
-        if(last_char == '.') {
-            do {
-                NumStr += last_char;
-                last_char = getchar();
-            } while (isdigit(last_char));
+    // Numbers without a '.' are ints, unless too long for one
+    if (isdigit(c)) {
+        const char *p = start;
+        uint64_t mantissa = 0;
+        int digits = 0, frac = 0;
+        for (; p != end && isdigit((unsigned char)*p); ++p, ++digits)
+            mantissa = mantissa * 10 + (*p - '0');
+        bool dot = p != end && *p == '.';
+        if (dot) {
+            for (++p; p != end && isdigit((unsigned char)*p); ++p, ++digits, ++frac)
+                mantissa = mantissa * 10 + (*p - '0');
+        }
+        SRC.Cur = p;
+        if (!dot && digits <= 18) {
+            NumVal.I = (int64_t)mantissa; // Global NumVal
+            NumType = T_INT;
+        } else {
+            NumVal.D = scan_number(start, p, mantissa, digits, frac);
+            NumType = T_DOUBLE;
         }
-        NumVal = strtod(NumStr.c_str(),0); // Global NumVal
         return _NUMBER;
     }
 
-    if (last_char == '#') { // Until end of line
-        do last_char = getchar();
-        while (last_char != EOF && last_char != '\n' && last_char != '\r');
-
-        if (last_char != EOF) return get_token();
+    // Two character operators
+    if (SRC.Cur + 1 != end && SRC.Cur[1] == '=') {
+        if (c == ':') {
+            SRC.Cur += 2;
+            return _ASSIGN;
+        }
+        if (c == '=') {
+            SRC.Cur += 2;
+            return _EQ;
+        }
     }
 
-    if (last_char == EOF) return _EOF;
-    int ThisChar = last_char;
-    last_char = getchar();
-    return ThisChar;
+    ++SRC.Cur;
+    return c;
 };
 
 
@@ -132,6 +308,7 @@ static int get_token_precedence() {
 
     switch(currToken) {
         case '=':
+        case _EQ:
             return 10;
         case '>':
             return 10;
@@ -154,17 +331,17 @@ static int get_token_precedence() {
 
 
 // <number>
-static std::unique_ptr<Expression> parse_numexpr() {
-    auto Result = llvm::make_unique<NumExpression>(NumVal);
+static ExprRef parse_numexpr() {
+    ExprRef Result = AST.num(NumVal, NumType);
     get_next_token(); 
-    return std::move(Result);
+    return Result;
 }
 
 // (<expression>)
-static std::unique_ptr<Expression> parse_paren() {
+static ExprRef parse_paren() {
     get_next_token(); // Pops current token, and sends control to parse Expression
     auto V = parse_expression();
-    if(!V) return nullptr;
+    if(!V) return 0;
     // Parse Expression will return to here, and checks for close parenth
     if (currToken != ')') {
         if (currToken != '}') return log_error("expected close");
@@ -173,36 +350,57 @@ static std::unique_ptr<Expression> parse_paren() {
     return V;
 }
 
+// [<expression>]... after a variable or call
+static ExprRef parse_index(ExprRef E) {
+    while (E && currToken == '[') {
+        get_next_token();
+        ExprRef Index = parse_expression();
+        if (!Index) return 0;
+        if (currToken != ']') return log_error("Expected ']' after index");
+        get_next_token();
+        E = AST.index(E, Index);
+    }
+    return E;
+}
+
 // <identifier>
-static std::unique_ptr<Expression> parse_idexp() {
-    std::string IdName = IdentStr;
+static ExprRef parse_idexp() {
+    SymbolID IdName = IdentSym;
     get_next_token(); // Consumes Identifier
     
-    if(currToken != '(') return llvm::make_unique<VarExpression>(IdName); // simple identifier = done
+    if(currToken == _ASSIGN) { // <identifier> := <expression>
+        get_next_token();
+        ExprRef Value = parse_expression();
+        if(!Value) return 0;
+        return AST.assign(IdName, Value);
+    }
+    if(currToken != '(') return parse_index(AST.var(IdName)); // simple identifier = done
 
     get_next_token(); // Consume open parenth
-    std::vector<std::unique_ptr<Expression>> Args;
+    llvm::SmallVector<ExprRef, 8> Args;
     if(currToken != ')') {
         while(1) {
-            if(auto Arg = parse_expression()) Args.push_back(std::move(Arg));
-            else return nullptr;
+            if(ExprRef Arg = parse_expression()) Args.push_back(Arg);
+            else return 0;
             if (currToken == ')') break;
             if (currToken != ',') return log_error("Expected ')' or ',' in argument list");
             get_next_token();
         }
     }
     get_next_token(); // Consume close parenth
-    return llvm::make_unique<CallExpression>(IdName, std::move(Args));
+    return parse_index(AST.call(IdName, Args));
 }
 
 // <primary>
-static std::unique_ptr<Expression> parse_primary() {
+static ExprRef parse_primary() {
 
     // Use switch to guide parsing
     switch (currToken) {
-        default:
-            printf("%c\n", currToken);
-            return log_error("unknown token");
+        default: {
+            char Msg[32] = "unknown token";
+            if (currToken > 0) snprintf(Msg, sizeof(Msg), "unknown token '%c'", currToken);
+            return log_error(Msg);
+        }
         case _IDENT:
             return parse_idexp();
         case _NUMBER:
@@ -210,44 +408,46 @@ static std::unique_ptr<Expression> parse_primary() {
         case '(':
             return parse_paren();
         case '{':
-            return parse_paren();
+            return parse_block();
         case _IF:
             return parse_if();
+        case _FOR:
+            return parse_for();
     }
 }
 
 // part of <operation>
-static std::unique_ptr<Expression> parse_rbinop(int current_prec, std::unique_ptr<Expression> leftSide) {
+static ExprRef parse_rbinop(int current_prec, ExprRef leftSide) {
     while(1) {
         int token_prec = get_token_precedence();
 
         if (token_prec < current_prec) return leftSide;
         
-        int binOp = currToken;
+        int binOp = currToken == _EQ ? '=' : currToken; // == is the same comparison as =
         get_next_token();
 
-        auto rightSide = parse_primary();
-        if(!rightSide) return nullptr;
+        ExprRef rightSide = parse_primary();
+        if(!rightSide) return 0;
 
         int next_prec = get_token_precedence();
         if(token_prec < next_prec) {
-            rightSide = parse_rbinop(token_prec+1, std::move(rightSide));
-            if(!rightSide) return nullptr;
+            rightSide = parse_rbinop(token_prec+1, rightSide);
+            if(!rightSide) return 0;
         }
 
-        leftSide = llvm::make_unique<OpExpression>(binOp, std::move(leftSide), std::move(rightSide));
+        leftSide = AST.op(binOp, leftSide, rightSide);
     }
 }
 
 // <operation>
-static std::unique_ptr<Expression> parse_expression() {
+static ExprRef parse_expression() {
     // Pops the current token and gets an operator
-    auto leftSide = parse_primary();
+    ExprRef leftSide = parse_primary();
     if(!leftSide) {
-        return nullptr;
+        return 0;
     }
     // Return the return of parsing right hand operator (initial precedence of 0, and move left side))
-    return parse_rbinop(0, std::move(leftSide));
+    return parse_rbinop(0, leftSide);
 }
 
 // <used to parse function imports 
@@ -255,30 +455,89 @@ static std::unique_ptr<ProtoFn> parse_prototype() {
     if (currToken != _IDENT)
         return log_errorp("Expected function name in prototype\n");
 
-    std::string fnName = IdentStr;
+    SymbolID fnName = IdentSym;
     get_next_token();
+    return parse_params(fnName, false);
+}
+
+// int | bool | double | array
+static bool parse_type(ValueType &T) {
+    if (currToken == _IDENT) {
+        if (IdentStr == "int") T = T_INT;
+        else if (IdentStr == "bool") T = T_BOOL;
+        else if (IdentStr == "double") T = T_DOUBLE;
+        else if (IdentStr == "array") T = T_ARRAY;
+        else return false;
+        get_next_token();
+        return true;
+    }
+    return false;
+}
 
+// (<identifier>[: <type>] [,]...)[: <type>] after the function name
+static std::unique_ptr<ProtoFn> parse_params(SymbolID fnName, bool Fast) {
     if (currToken != '(')
         return log_errorp("Expected '(' in prototype\n");
 
-    std::vector<std::string> argNames;
+    std::vector<SymbolID> argNames;
+    std::vector<ValueType> argTypes;
 
-    while (get_next_token() == _IDENT) argNames.push_back(IdentStr);
+    get_next_token();
+    while (currToken == _IDENT) {
+        argNames.push_back(IdentSym);
+        argTypes.push_back(T_DOUBLE); // Untyped parameters are doubles
+        if (get_next_token() == ':') {
+            get_next_token();
+            if (!parse_type(argTypes.back())) return log_errorp("Expected a type: int, bool, double or array\n");
+        }
+        if (currToken == ',') get_next_token();
+    }
 
     if(currToken != ')')
         return log_errorp("Expected ')' in prototype\n");
 
-    get_next_token();
-    return llvm::make_unique<ProtoFn>(fnName, std::move(argNames));
+    auto Proto = llvm::make_unique<ProtoFn>(fnName, std::move(argNames), Fast);
+    Proto->setArgTypes(std::move(argTypes));
+    if (get_next_token() == ':') {
+        ValueType Ret;
+        get_next_token();
+        if (!parse_type(Ret)) return log_errorp("Expected a type: int, bool, double or array\n");
+        Proto->declareReturn(Ret);
+    }
+    return Proto;
 }
 
 // <function>
 static std::unique_ptr<FnExpression> parse_definition() {
+    unsigned Line = JitDump ? current_line() : 0;
     get_next_token();
-    auto Proto = parse_prototype();
+    // fn [fast] [memo] name(...), in any order; fn fast(...) defines "fast"
+    bool Fast = false, Memo = false;
+    SymbolID fnName;
+    while (1) {
+        if (currToken == _MEMO) {
+            Memo = true;
+            get_next_token();
+            continue;
+        }
+        if (currToken != _IDENT) {
+            log_error("Expected function name in prototype\n");
+            return nullptr;
+        }
+        fnName = IdentSym;
+        bool Annotation = IdentStr == "fast";
+        get_next_token();
+        if (!Annotation || (currToken != _IDENT && currToken != _MEMO)) break;
+        Fast = true;
+    }
+    std::unique_ptr<ProtoFn> Proto = parse_params(fnName, Fast);
     if(!Proto) return nullptr;
-    if(auto E = parse_expression())
-        return llvm::make_unique<FnExpression>(std::move(Proto), std::move(E));
+    Proto->setMemo(Memo);
+    if (JitDump) DefinitionLines[SYMBOLS.name(fnName)] = Line;
+    if(ExprRef E = parse_expression()) {
+        mark_tail_calls(AST, E);
+        return llvm::make_unique<FnExpression>(std::move(Proto), E);
+    }
     
     return nullptr;
 }
@@ -286,44 +545,124 @@ static std::unique_ptr<FnExpression> parse_definition() {
 // <import>
 static std::unique_ptr<ProtoFn> parse_import() {
     get_next_token(); // Eat the "import" token
-    return parse_prototype();
+    auto Proto = parse_prototype();
+    if (Proto && !Proto->hasDeclaredReturn()) Proto->declareReturn(T_DOUBLE); // Nothing to infer from
+    return Proto;
 }
 
 
-static std::unique_ptr<FnExpression> parse_top_expr() {
-    if (auto E = parse_expression()) {
-        auto Proto = llvm::make_unique<ProtoFn>("__anonexpr",std::vector<std::string>());
-        return llvm::make_unique<FnExpression>(std::move(Proto), std::move(E));
-    }
+// Wraps E in the function Entry
+static std::unique_ptr<FnExpression> top_expr(SymbolID Entry, ExprRef E) {
+    mark_tail_calls(AST, E);
+    auto Proto = llvm::make_unique<ProtoFn>(Entry, std::vector<SymbolID>());
+    Proto->declareReturn(T_DOUBLE); // The caller reads a double whatever the type
+    return llvm::make_unique<FnExpression>(std::move(Proto), E);
+}
+
+static std::unique_ptr<FnExpression> parse_top_expr(SymbolID Entry) {
+    if (ExprRef E = parse_expression()) return top_expr(Entry, E);
     return nullptr;
 }
 
-static std::unique_ptr<Expression> parse_if() {
+static ExprRef parse_if() {
     // Consume "if"
     get_next_token();
     
     // Condition
-    auto cond = parse_expression();
-    if (!cond) return nullptr; 
+    ExprRef cond = parse_expression();
+    if (!cond) return 0; 
 
     // Body
-    auto body = parse_expression();
-    if (!body) return nullptr;
+    ExprRef body = parse_expression();
+    if (!body) return 0;
 
     // Else 
     if (currToken != _ELSE) return log_error("Expected 'else'");
     get_next_token();
-    auto xelse = parse_expression();
-    if (!xelse) return nullptr;
-    return llvm::make_unique<IfExpression>(std::move(cond), std::move(body), std::move(xelse));
+    ExprRef xelse = parse_expression();
+    if (!xelse) return 0;
+    return AST.ifexpr(cond, body, xelse);
     
     
 }
 
+// { <item>; <item>; ... } evaluates the items in order, the last one is its value
+static ExprRef parse_block() {
+    get_next_token(); // Consume '{'
+    llvm::SmallVector<ExprRef, 8> Items;
+    while (1) {
+        ExprRef Item = currToken == _LET ? parse_let() : parse_expression();
+        if (!Item) return 0;
+        Items.push_back(Item);
+        if (currToken == ';') get_next_token();
+        else if (currToken != '}') return log_error("Expected ';' or '}' in block");
+        if (currToken == '}') break; // Also after a trailing ';'
+    }
+    get_next_token(); // Consume '}'
+    if (Items.size() == 1 && AST[Items[0]].Kind != LET_EXPR) return Items[0];
+    return AST.seq(Items);
+}
+
+// let <identifier> = <expression>, only as a block item
+static ExprRef parse_let() {
+    // Consume "let"
+    get_next_token();
+
+    if (currToken != _IDENT) return log_error("Expected identifier after 'let'");
+    SymbolID var = IdentSym;
+    get_next_token();
+
+    if (currToken != '=' && currToken != _ASSIGN) return log_error("Expected '=' after let variable");
+    get_next_token();
+
+    ExprRef init = parse_expression();
+    if (!init) return 0;
+    return AST.let(var, init);
+}
+
+// for <identifier> = <start>, <end>[, <step>] <body>
+static ExprRef parse_for() {
+    // Consume "for"
+    get_next_token();
+
+    if (currToken != _IDENT) return log_error("Expected identifier after 'for'");
+    SymbolID var = IdentSym;
+    get_next_token();
+
+    if (currToken != '=') return log_error("Expected '=' after for variable");
+    get_next_token();
+
+    ExprRef start = parse_expression();
+    if (!start) return 0;
+    if (currToken != ',') return log_error("Expected ',' after for start value");
+    get_next_token();
+
+    ExprRef end = parse_expression();
+    if (!end) return 0;
+
+    // Optional step, 1.0 when left out
+    ExprRef step = 0;
+    if (currToken == ',') {
+        get_next_token();
+        step = parse_expression();
+        if (!step) return 0;
+    }
+
+    ExprRef body = parse_expression();
+    if (!body) return 0;
+    return AST.forexpr(var, start, end, step, body);
+}
+
 
 static void handle_definition() {
     if(auto FnExpr = parse_definition()) {
-        if(auto *FnIR = FnExpr->codegen()) {
+        if (HotThreshold) {
+            // Interpreted until hot, nothing to show yet
+            SymbolID Name = FnExpr->getProto().getName();
+            if (define_interpreted(*FnExpr))
+                fprintf(stderr, "Read function definition %s (interpreted)\n", SYMBOLS.name(Name).str().c_str());
+        } else if(auto *FnIR = FnExpr->codegen()) {
+            ModuleHasDefinitions = true;
             fprintf(stderr, "Read function definition");
             FnIR->print(llvm::errs());
             fprintf(stderr,"\n");
@@ -331,39 +670,230 @@ static void handle_definition() {
     } else {
         get_next_token();
     }
+    AST.reset(); // Frees the statement's nodes in one shot
+}
+
+// An import of a libm function with its libm signature is an intrinsic
+static void map_intrinsic(ProtoFn &P) {
+    for (ValueType T : P.getArgTypes())
+        if (T != T_DOUBLE) return;
+    if (P.getReturnType() == T_DOUBLE)
+        P.setIntrinsic(math_intrinsic(SYMBOLS.name(P.getName()), P.getArgs().size()));
 }
 
 static void handle_import() {
     if(auto ImportExpression = parse_import()) {
+        map_intrinsic(*ImportExpression);
         if(auto *ImIR = ImportExpression->codegen()) {
             fprintf(stderr, "Parsed an import.\n");
             ImIR->print(llvm::errs());
             fprintf(stderr, "\n");
+            // Later modules redeclare it from here
+            SymbolID Name = ImportExpression->getName();
+            symbol_slot(function_protos, Name) = std::move(ImportExpression);
+            if (HotThreshold) define_import(Name);
         }
     } else {
         get_next_token();
     }
 }
 
+// --- Top level batching ---
+// Consecutive top-level expressions share one module: each gets its own entry
+// point (__anonexpr, __anonexpr1, ...), the module is compiled once when the
+// run ends, and the entries are called in source order. A limit of 1 keeps
+// the interactive behaviour of evaluating each expression as it is read.
+
+struct PendingTop {
+    SymbolID Entry;          // Null entry: the expression failed to compile
+    std::string Diagnostics; // Errors reported while it was parsed
+    bool Valid;
+    bool Folded;             // Constant, Result is its value and there is no entry to call
+    double Result;
+};
+
+static thread_local unsigned TopBatchLimit = 1;
+static thread_local std::vector<PendingTop> PendingTops;
+
+static SymbolID top_entry_name(unsigned Idx) {
+    static thread_local std::vector<SymbolID> Names;
+    while (Names.size() <= Idx) {
+        std::string Name = "__anonexpr";
+        if (!Names.empty()) Name += std::to_string(Names.size());
+        Names.push_back(SYMBOLS.intern(Name));
+    }
+    return Names[Idx];
+}
+
+// Definitions live on in the JIT, the expression modules are thrown away
+static void commit_definitions() {
+    if (!ModuleHasDefinitions) return;
+    add_module(std::move(MODULE));
+    initialize_module();
+    ModuleHasDefinitions = false;
+}
+
+static void flush_top() {
+    if (PendingTops.empty()) return;
+    DeferDiagnostics = false;
+
+    bool Compiled = false;
+    for (auto &P : PendingTops) Compiled |= P.Valid && !P.Folded;
+
+    llvm::orc::KaleidoscopeJIT::ModuleHandleT H;
+    if (Compiled) {
+        H = add_module(std::move(MODULE));
+        initialize_module();
+    }
+
+    for (auto &P : PendingTops) {
+        fputs(P.Diagnostics.c_str(), stderr);
+        if (!P.Valid) continue;
+        if (P.Folded) {
+            fprintf(stderr, "Evaluated to %f\n", P.Result);
+            continue;
+        }
+
+	auto expr_symbol = jit->findSymbol(SYMBOLS.name(P.Entry).str());
+	assert(expr_symbol && "Function not found.");
+	double (*fp)() = (double (*)())(intptr_t)expr_symbol.getAddress();
+        double Result;
+        {
+            StageScope Timing(STAGE_EXECUTE);
+            Result = fp();
+            release_arrays();
+        }
+        fprintf(stderr, "Evaluated to %f\n", Result);
+    }
+
+    if (Compiled) jit->removeModule(H);
+    PendingTops.clear();
+}
+
+// Compiles E, held in AST, and every interpreted function it calls into a
+// module of its own, H, as Entry. Null on an error.
+static double (*compile_top(SymbolID Entry, ExprRef E, llvm::orc::KaleidoscopeJIT::ModuleHandleT &H))() {
+    commit_definitions();
+    auto FnExpr = top_expr(Entry, E);
+    if (!FnExpr->check() || !compile_callees(AST) || !FnExpr->codegen()) return nullptr;
+    H = add_module(std::move(MODULE));
+    initialize_module();
+    auto Sym = jit->findSymbol(SYMBOLS.name(Entry).str());
+    return (double (*)())(intptr_t)Sym.getAddress();
+}
+
+// A top-level expression with a loop, with the interpreter on
+static bool run_compiled_top(ExprRef E, double &Result) {
+    SymbolID Entry = SYMBOLS.intern("__loop");
+    llvm::orc::KaleidoscopeJIT::ModuleHandleT H;
+    double (*fp)() = compile_top(Entry, E, H);
+    if (!fp) return false;
+    {
+        StageScope Timing(STAGE_EXECUTE);
+        Result = fp();
+        release_arrays();
+    }
+    jit->removeModule(H);
+    return true;
+}
+
 static void handle_top() {
-    if(auto FnExpr = parse_top_expr()) {
-        if(FnExpr->codegen()) {
-            auto H = jit->addModule(std::move(MODULE));
-	    initialize_module();
-	    
-
-	    auto expr_symbol = jit->findSymbol("__anonexpr");
-	    assert(expr_symbol && "Function not found.");
-	    double (*fp)() = (double (*)())(intptr_t)expr_symbol.getAddress();
-            fprintf(stderr, "Evaluated to %f\n", fp());
-
-	    jit->removeModule(H);
-       	}
-        
+    if (AotMode) { // Compiled code has nowhere to run it
+        if (parse_expression()) fprintf(stderr, "tlangc: top-level expression skipped\n");
+        else get_next_token();
+        AST.reset();
+        return;
+    }
+    if (HotThreshold) {
+        if (ExprRef E = parse_expression()) {
+            double Result;
+            if (has_loop(AST) ? run_compiled_top(E, Result) : eval_top(E, Result))
+                fprintf(stderr, "Evaluated to %f\n", Result);
+        } else {
+            get_next_token();
+        }
+        AST.reset();
+        return;
+    }
+
+    if (PendingTops.empty()) commit_definitions();
+
+    SymbolID Entry = top_entry_name(PendingTops.size());
+    if (JitDump) DefinitionLines[SYMBOLS.name(Entry)] = current_line();
+    bool Valid = false, Folded = false;
+    double Result = 0.0;
+    if(auto FnExpr = parse_top_expr(Entry)) {
+        Valid = FnExpr->check();
+        const ExprNode &R = AST[FnExpr->getBody()];
+        Folded = Valid && R.Kind == NUM_EXPR; // Answered without a module
+        if (Folded) Result = convert_value(AST.value(R), R.Type, T_DOUBLE).D;
+        else if (Valid) Valid = FnExpr->codegen() != nullptr;
     } else {
 	get_next_token();    
+    }
+    AST.reset();
+
+    PendingTops.push_back(PendingTop{Entry, std::move(DeferredDiagnostics), Valid, Folded, Result});
+    DeferredDiagnostics.clear();
+    DeferDiagnostics = true;
+
+    if (PendingTops.size() >= TopBatchLimit) flush_top();
 }
+// memo: prints every memo table's counters
+static void handle_memo() {
+    get_next_token();
+    print_memo_stats();
 }
+
+// stats: pipeline counters and stage times so far
+static void handle_stats() {
+    get_next_token();
+    print_stats();
+}
+
+// bench expr [N]: compiles expr and reports on N calls of it (default 100),
+// interpreted or not. See measure.h.
+static void handle_bench() {
+    get_next_token();
+    ExprRef E = parse_expression();
+    if (!E) {
+        get_next_token();
+        AST.reset();
+        return;
+    }
+    if (AotMode) { // Nothing runs, and compiling it would take the definitions read so far
+        if (currToken == _NUMBER) get_next_token();
+        fprintf(stderr, "tlangc: bench skipped\n");
+        AST.reset();
+        return;
+    }
+    uint64_t Runs = 100;
+    if (currToken == _NUMBER) {
+        Runs = NumVal.I;
+        bool Count = NumType == T_INT && NumVal.I > 0;
+        get_next_token();
+        if (!Count) {
+            log_error("bench expects a positive integer run count.");
+            AST.reset();
+            return;
+        }
+    }
+
+    SymbolID Entry = SYMBOLS.intern("__bench");
+    llvm::orc::KaleidoscopeJIT::ModuleHandleT H;
+    double (*fp)() = compile_top(Entry, E, H);
+    AST.reset();
+    if (!fp) return;
+
+    double Result;
+    {
+        StageScope Timing(STAGE_EXECUTE);
+        Result = measure(fp, Runs, release_arrays);
+    }
+    fprintf(stderr, "Evaluated to %f\n", Result);
+    jit->removeModule(H);
+}
+
 static void handle_return() {
     get_next_token();
 }
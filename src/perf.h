@@ -0,0 +1,227 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// --- Profiler support ---
+// perf sees JIT code as anonymous memory. -perf=map writes
+// /tmp/perf-<pid>.map, a line per function with its address, size and name,
+// which perf report reads as is. -perf=jitdump writes jit-<pid>.dump to
+// $JITDUMPDIR (else /tmp) in perf's jitdump format, for
+//
+//   perf record -k 1 ./tlang -perf=jitdump script.tl
+//   perf inject --jit -i perf.data -o perf.jit.data && perf report -i perf.jit.data
+//
+// which also keeps each function's code for annotation and attributes it to
+// the line of its fn (or top-level expression) in the script. Lines are per
+// function: nodes carry no positions, so there is no finer line table.
+// -perf=map,jitdump writes both.
+//
+// Every function the object layer loads is recorded once it is relocated:
+// definitions, __anonexpr entries, trampolines, clones and memo bodies, code
+// from the object cache included, and again when it is redefined. The files
+// belong to the process; sessions on other threads write to them in turn.
+
+static bool PerfMap = false;
+static bool JitDump = false;
+static FILE *PerfMapFile = nullptr;
+static FILE *JitDumpFile = nullptr;
+static uint64_t JitCodeIndex = 0;
+static std::mutex ProfileLock;                     // Guards the two files and JitCodeIndex
+static std::string ProfileSource = "<stdin>";      // File name in jitdump line records
+static thread_local llvm::StringMap<unsigned> DefinitionLines; // By function name
+
+struct LoadedFunction {
+    std::string Name;
+    uint64_t Addr;
+    uint64_t Size;
+};
+
+static thread_local std::vector<LoadedFunction> PendingLoads; // Loaded, not yet relocated
+
+// -perf=map, -perf=jitdump or both, comma separated
+static bool parse_profile_option(llvm::StringRef List) {
+    llvm::SmallVector<llvm::StringRef, 2> Kinds;
+    List.split(Kinds, ',', -1, false);
+    for (llvm::StringRef K : Kinds) {
+        if (K == "map") PerfMap = true;
+        else if (K == "jitdump") JitDump = true;
+        else return false;
+    }
+    return !Kinds.empty();
+}
+
+// jitdump records, see tools/perf/Documentation/jitdump-specification.txt
+struct JitDumpHeader {
+    uint32_t Magic;      // 'JiTD'
+    uint32_t Version;
+    uint32_t TotalSize;  // Of this header
+    uint32_t ElfMach;
+    uint32_t Pad1;
+    uint32_t Pid;
+    uint64_t Timestamp;
+    uint64_t Flags;
+};
+
+struct JitRecordHeader {
+    uint32_t Id;
+    uint32_t TotalSize;  // Including what follows the fixed part
+    uint64_t Timestamp;
+};
+
+enum { JIT_CODE_LOAD = 0, JIT_CODE_DEBUG_INFO = 2 };
+
+struct JitCodeLoad {     // Followed by the name and the code
+    JitRecordHeader Header;
+    uint32_t Pid;
+    uint32_t Tid;
+    uint64_t Vma;
+    uint64_t CodeAddr;
+    uint64_t CodeSize;
+    uint64_t CodeIndex;
+};
+
+struct JitDebugInfo {    // Followed by the entries
+    JitRecordHeader Header;
+    uint64_t CodeAddr;
+    uint64_t NumEntries;
+};
+
+struct JitDebugEntry {   // Followed by the file name
+    uint64_t Addr;
+    int32_t Line;
+    int32_t Discrim;
+};
+
+// perf record -k 1 stamps samples with the same clock
+static uint64_t profile_timestamp() {
+    struct timespec TS;
+    clock_gettime(CLOCK_MONOTONIC, &TS);
+    return (uint64_t)TS.tv_sec * 1000000000 + TS.tv_nsec;
+}
+
+static uint32_t elf_machine() {
+#if defined(__x86_64__)
+    return 62;  // EM_X86_64
+#elif defined(__aarch64__)
+    return 183; // EM_AARCH64
+#elif defined(__i386__)
+    return 3;   // EM_386
+#else
+    return 0;
+#endif
+}
+
+// Opens the outputs -perf asked for, false when one cannot be written
+static bool open_profile_outputs(const char *Script) {
+    if (Script) {
+        char *Real = realpath(Script, nullptr);
+        ProfileSource = Real ? Real : Script;
+        free(Real);
+    }
+    if (PerfMap) {
+        std::string Path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        if (!(PerfMapFile = fopen(Path.c_str(), "w"))) {
+            fprintf(stderr, "tlang: cannot write %s\n", Path.c_str());
+            return false;
+        }
+    }
+    if (JitDump) {
+        const char *Dir = getenv("JITDUMPDIR");
+        std::string Path = std::string(Dir ? Dir : "/tmp") + "/jit-" + std::to_string(getpid()) + ".dump";
+        if (!(JitDumpFile = fopen(Path.c_str(), "w+"))) {
+            fprintf(stderr, "tlang: cannot write %s\n", Path.c_str());
+            return false;
+        }
+        JitDumpHeader H{0x4A695444, 1, sizeof(JitDumpHeader), elf_machine(), 0, (uint32_t)getpid(),
+                        profile_timestamp(), 0};
+        fwrite(&H, sizeof(H), 1, JitDumpFile);
+        fflush(JitDumpFile);
+        // perf finds the dump through this executable mapping of it
+        if (mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(JitDumpFile), 0) ==
+            MAP_FAILED) {
+            fprintf(stderr, "tlang: cannot map the jitdump file\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Line of Name's definition: memo bodies and clones (name.suffix) and
+// trampolines (__tier_name) share their function's
+static unsigned definition_line(llvm::StringRef Name) {
+    if (Name.startswith("__tier_")) Name = Name.substr(strlen("__tier_"));
+    auto It = DefinitionLines.find(Name);
+    if (It == DefinitionLines.end()) It = DefinitionLines.find(Name.split('.').first);
+    return It == DefinitionLines.end() ? 0 : It->second;
+}
+
+static void write_jitdump(const LoadedFunction &F) {
+    uint64_t Now = profile_timestamp();
+    if (unsigned Line = definition_line(F.Name)) { // Must come before the code it describes
+        JitDebugInfo D{{JIT_CODE_DEBUG_INFO, 0, Now}, F.Addr, 1};
+        JitDebugEntry E{F.Addr, (int32_t)Line, 0};
+        D.Header.TotalSize = sizeof(D) + sizeof(E) + ProfileSource.size() + 1;
+        fwrite(&D, sizeof(D), 1, JitDumpFile);
+        fwrite(&E, sizeof(E), 1, JitDumpFile);
+        fwrite(ProfileSource.c_str(), ProfileSource.size() + 1, 1, JitDumpFile);
+    }
+    JitCodeLoad R{{JIT_CODE_LOAD, 0, Now}, (uint32_t)getpid(), (uint32_t)syscall(SYS_gettid),
+                  F.Addr, F.Addr, F.Size, JitCodeIndex++};
+    R.Header.TotalSize = sizeof(R) + F.Name.size() + 1 + F.Size;
+    fwrite(&R, sizeof(R), 1, JitDumpFile);
+    fwrite(F.Name.c_str(), F.Name.size() + 1, 1, JitDumpFile);
+    fwrite((const void *)F.Addr, F.Size, 1, JitDumpFile);
+}
+
+// Object layer hooks: loading assigns the addresses, finalizing relocates
+// the code, and only then is it worth copying into the dump.
+static void profile_loaded_object(const llvm::object::ObjectFile &Obj, const llvm::RuntimeDyld::LoadedObjectInfo &L) {
+    if (!PerfMapFile && !JitDumpFile) return;
+    llvm::object::OwningBinary<llvm::object::ObjectFile> Loaded = L.getObjectForDebug(Obj); // At load addresses
+    if (!Loaded.getBinary()) return;
+    for (const auto &P : llvm::object::computeSymbolSizes(*Loaded.getBinary())) {
+        llvm::object::SymbolRef Sym = P.first;
+        auto Type = Sym.getType();
+        auto Name = Sym.getName();
+        auto Addr = Sym.getAddress();
+        if (!Type || *Type != llvm::object::SymbolRef::ST_Function || !Name || !Addr || !P.second) {
+            if (!Type) llvm::consumeError(Type.takeError());
+            if (!Name) llvm::consumeError(Name.takeError());
+            if (!Addr) llvm::consumeError(Addr.takeError());
+            continue;
+        }
+        PendingLoads.push_back(LoadedFunction{Name->str(), *Addr, P.second});
+    }
+}
+
+static void profile_finalized_objects() {
+    if (PendingLoads.empty()) return;
+    std::lock_guard<std::mutex> Lock(ProfileLock);
+    for (const LoadedFunction &F : PendingLoads) {
+        if (PerfMapFile)
+            fprintf(PerfMapFile, "%llx %llx %s\n", (unsigned long long)F.Addr, (unsigned long long)F.Size,
+                    F.Name.c_str());
+        if (JitDumpFile) write_jitdump(F);
+    }
+    PendingLoads.clear();
+    if (PerfMapFile) fflush(PerfMapFile); // perf may read it while we run
+    if (JitDumpFile) fflush(JitDumpFile);
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef STAGES_H
+#define STAGES_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// --- Stage timing ---
+// -time-stages prints at exit how long the run spent lexing, parsing,
+// checking, generating IR, optimizing, compiling in the JIT, looking up
+// symbols and executing; -time-json=FILE writes the same, with the counters
+// below, for bench/suite.sh. Every stage is charged
+// its own time only: a stage entered inside another (the lexer inside the
+// parser, optimization inside codegen, a lazy JIT compile or a promotion
+// inside execution) pauses the outer one until it is done. Time outside
+// every stage, LLVM's startup included, is "other".
+
+enum Stage {
+    STAGE_OTHER,
+    STAGE_LEX,
+    STAGE_PARSE,
+    STAGE_CHECK,     // Resolver, inference and folding
+    STAGE_CODEGEN,
+    STAGE_OPTIMIZE,
+    STAGE_JIT,       // Adding modules and lazy compiles
+    STAGE_LOOKUP,    // KaleidoscopeJIT::findSymbol
+    STAGE_EXECUTE,   // Compiled entries and the interpreter
+    NUM_STAGES
+};
+
+static const char *const STAGE_NAMES[NUM_STAGES] = {
+    "other", "lex", "parse", "check", "codegen", "optimize", "jit", "lookup", "execute"};
+
+static thread_local bool StageTiming = false; // Clocks running, for either option
+static thread_local bool TimeStages = false;  // -time-stages
+static thread_local std::string StagesJSON;   // -time-json=FILE
+static thread_local double StageMs[NUM_STAGES];
+static thread_local uint64_t StageCount[NUM_STAGES]; // Times each stage was entered
+static thread_local Stage CurrentStage = STAGE_OTHER;
+static thread_local std::chrono::steady_clock::time_point StageMark = std::chrono::steady_clock::now();
+
+// Charges the time since the last switch to the running stage
+static void switch_stage(Stage S) {
+    auto Now = std::chrono::steady_clock::now();
+    StageMs[CurrentStage] += std::chrono::duration<double, std::milli>(Now - StageMark).count();
+    StageMark = Now;
+    CurrentStage = S;
+}
+
+// Runs its scope as stage S, free when timing is off
+class StageScope {
+    Stage Outer;
+public:
+    explicit StageScope(Stage S) : Outer(CurrentStage) {
+        if (!StageTiming) return;
+        switch_stage(S);
+        StageCount[S]++;
+    }
+    ~StageScope() {
+        if (StageTiming) switch_stage(Outer);
+    }
+};
+
+// --- Counters ---
+// Always kept, they cost an increment each. The stats statement prints them
+// with the stage times (when those are on) in the middle of a session.
+
+struct PipelineCounters {
+    uint64_t Tokens = 0;       // Lexed
+    uint64_t Nodes = 0;        // AST nodes built
+    uint64_t Functions = 0;    // Bodies code generated
+    uint64_t InstsBefore = 0;  // IR instructions going into the optimizer
+    uint64_t InstsAfter = 0;   // and coming out
+    uint64_t Modules = 0;      // Added to the JIT
+    uint64_t CodeBytes = 0;    // Machine code sections the JIT allocated
+    uint64_t DataBytes = 0;    // Data sections
+    uint64_t LiveBytes = 0;    // Both, for modules still in the JIT
+};
+
+static thread_local PipelineCounters Counters;
+
+static double total_stage_ms() {
+    switch_stage(CurrentStage);
+    double Total = 0;
+    for (double Ms : StageMs) Total += Ms;
+    return Total;
+}
+
+static void print_stage_times() {
+    double Total = total_stage_ms();
+    fprintf(stderr, "time by stage (%.3f ms in all):\n", Total);
+    for (int S = 0; S != NUM_STAGES; S++)
+        fprintf(stderr, "  %-9s %10.3f ms %5.1f%%  %llu\n", STAGE_NAMES[S], StageMs[S],
+                Total > 0 ? 100 * StageMs[S] / Total : 0.0, (unsigned long long)StageCount[S]);
+}
+
+static void print_counters() {
+    const PipelineCounters &C = Counters;
+    fprintf(stderr, "tokens lexed:      %llu\n", (unsigned long long)C.Tokens);
+    fprintf(stderr, "AST nodes:         %llu\n", (unsigned long long)C.Nodes);
+    fprintf(stderr, "functions:         %llu\n", (unsigned long long)C.Functions);
+    fprintf(stderr, "IR instructions:   %llu before optimization, %llu after\n", (unsigned long long)C.InstsBefore,
+            (unsigned long long)C.InstsAfter);
+    fprintf(stderr, "JIT modules:       %llu\n", (unsigned long long)C.Modules);
+    fprintf(stderr, "JIT bytes:         %llu code, %llu data, %llu in use\n", (unsigned long long)C.CodeBytes,
+            (unsigned long long)C.DataBytes, (unsigned long long)C.LiveBytes);
+}
+
+// stats: counters, and stage times when they are kept
+static void print_stats() {
+    print_counters();
+    if (StageTiming) print_stage_times();
+    else fprintf(stderr, "stage times are off, run with -time-stages\n");
+}
+
+// {"source": ..., "opt_level": ..., "tier_threshold": ..., "total_ms": ...,
+//  "stages": {"lex": {"ms": ..., "count": ...}, ...}, "counters": {"tokens": ..., ...}}
+static bool write_stage_json(const std::string &Path, const char *Source, unsigned OptLevel, unsigned Threshold) {
+    FILE *F = fopen(Path.c_str(), "w");
+    if (!F) {
+        fprintf(stderr, "tlang: cannot write %s\n", Path.c_str());
+        return false;
+    }
+    std::string Name;
+    for (const char *C = Source ? Source : "<stdin>"; *C; C++) {
+        if (*C == '"' || *C == '\\') Name += '\\';
+        Name += *C;
+    }
+    fprintf(F, "{\"source\": \"%s\", \"opt_level\": %u, \"tier_threshold\": %u, \"total_ms\": %.3f, \"stages\": {",
+            Name.c_str(), OptLevel, Threshold, total_stage_ms());
+    for (int S = 0; S != NUM_STAGES; S++)
+        fprintf(F, "%s\"%s\": {\"ms\": %.3f, \"count\": %llu}", S ? ", " : "", STAGE_NAMES[S], StageMs[S],
+                (unsigned long long)StageCount[S]);
+    const PipelineCounters &C = Counters;
+    fprintf(F, "}, \"counters\": {\"tokens\": %llu, \"nodes\": %llu, \"functions\": %llu, "
+               "\"insts_before\": %llu, \"insts_after\": %llu, \"modules\": %llu, "
+               "\"code_bytes\": %llu, \"data_bytes\": %llu, \"live_bytes\": %llu}}\n",
+            (unsigned long long)C.Tokens, (unsigned long long)C.Nodes, (unsigned long long)C.Functions,
+            (unsigned long long)C.InstsBefore, (unsigned long long)C.InstsAfter, (unsigned long long)C.Modules,
+            (unsigned long long)C.CodeBytes, (unsigned long long)C.DataBytes, (unsigned long long)C.LiveBytes);
+    return fclose(F) == 0;
+}
+
+#endif
@@ -0,0 +1,403 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include "fold.h"
+#include "measure.h"
+#include "memo.h"
+
+// --- Tiered execution ---
+// Definitions are not code generated when they are read. The interpreter
+// walks their nodes directly and counts calls (from other functions or the
+// top level) and loop iterations (self recursion). When the two together
+// reach HotThreshold the function, and every interpreted function it can
+// reach, is code generated into one module and handed to the JIT. Each gets
+// a trampoline taking its arguments as an array of 64-bit slots (the bits of
+// a Value) and returning one the same way; interpreted callers check
+// for it on every call, so they switch to native code at their next call.
+// A function with a for loop is compiled at its first call instead: how many
+// times a loop goes round is only known once it starts, too late to leave
+// the interpreter for that call. Likewise a top-level expression with a loop
+// goes through the JIT.
+// A threshold of 0 turns the interpreter off: definitions are compiled as
+// they are read and top-level expressions always go through the JIT.
+
+struct FnInfo {
+    ExprArena Body;          // The definition's nodes, kept after the statement
+    ExprRef Root = 0;
+    unsigned NumParams = 0;
+    unsigned NumSlots = 0;   // Interpreter frame size, parameters first
+    uint64_t Calls = 0;
+    uint64_t Loops = 0;
+    bool Import = false;     // Host function, always called natively
+    bool HasLoop = false;    // Compiled at the first call
+    bool NoJIT = false;      // Promotion failed, stay interpreted
+    int64_t (*Entry)(const Value *Args) = nullptr; // Native trampoline once promoted
+};
+
+static thread_local unsigned HotThreshold = 1000;
+static thread_local std::vector<std::unique_ptr<FnInfo>> Functions; // By SymbolID
+
+static Value call_function(SymbolID Callee, const Value *Args, SymbolID Caller);
+static bool count_call(FnInfo &F, SymbolID Callee, SymbolID Caller);
+
+
+
+//                     //
+// --- Interpreter --- //
+//                     //
+
+static Value interp(const ExprArena &Nodes, ExprRef E, Value *Frame, SymbolID Self);
+
+static Value interp_builtin(const ExprArena &Nodes, const ExprNode &N, Value *Frame, SymbolID Self) {
+    auto Args = Nodes.args(N);
+    Value V;
+    switch (N.Op) {
+        case B_LEN:
+            V.I = interp(Nodes, Args[0], Frame, Self).A->Len;
+            break;
+        case B_DOT: {
+            Array *X = interp(Nodes, Args[0], Frame, Self).A;
+            V.D = reduce_array(N.Op, X, interp(Nodes, Args[1], Frame, Self).A);
+            break;
+        }
+        case B_MAP: {
+            SymbolID Fn = Nodes[Args[0]].A;
+            const ProtoFn &P = *function_protos[Fn];
+            Array *X = interp(Nodes, Args[1], Frame, Self).A;
+            V.A = array_new(RUNTIME.get(), X->Len);
+            for (int64_t i = 0; i < X->Len; i++) {
+                Value Arg;
+                Arg.D = X->Data[i];
+                Arg = convert_value(Arg, T_DOUBLE, P.getArgTypes()[0]);
+                V.A->Data[i] = convert_value(call_function(Fn, &Arg, Self), P.getReturnType(), T_DOUBLE).D;
+            }
+            break;
+        }
+        case B_RANGE: {
+            int64_t Count = convert_value(interp(Nodes, Args[0], Frame, Self), Nodes[Args[0]].Type, T_INT).I;
+            V.A = array_new(RUNTIME.get(), Count > 0 ? Count : 0);
+            for (int64_t i = 0; i < V.A->Len; i++) V.A->Data[i] = (double)i;
+            break;
+        }
+        default: // sum, min, max
+            V.D = reduce_array(N.Op, interp(Nodes, Args[0], Frame, Self).A, nullptr);
+            break;
+    }
+    return V;
+}
+
+// Comparisons follow the unordered predicates codegen_op emits, and the if
+// condition the ordered not-equal of codegen_if, so both tiers agree on NaN.
+// Loop iterations count towards the running function's promotion. Branches
+// of an if and self tail calls continue in the same activation, so tail
+// recursion runs in constant stack here too. Each step only widens, so the
+// result is converted once, from the last node's type to that of E.
+static Value interp(const ExprArena &Nodes, ExprRef E, Value *Frame, SymbolID Self) {
+    ValueType Want = Nodes[E].Type;
+    for (;;) {
+        const ExprNode &N = Nodes[E];
+        Value V;
+        switch (N.Kind) {
+            case NUM_EXPR:
+                V = Nodes.value(N);
+                break;
+            case VAR_EXPR:
+                V = Frame[N.B];
+                break;
+            case OP_EXPR: {
+                const ExprNode &A = Nodes[N.A], &B = Nodes[N.B];
+                ValueType T = N.Op == '/' ? T_DOUBLE : arith_type(join_types(A.Type, B.Type));
+                Value L = convert_value(interp(Nodes, N.A, Frame, Self), A.Type, T);
+                Value R = convert_value(interp(Nodes, N.B, Frame, Self), B.Type, T);
+                V = interp_op(N.Op, T, L, R);
+                break;
+            }
+            case CALL_EXPR: {
+                auto Types = function_protos[N.A]->getArgTypes();
+                auto ArgRefs = Nodes.args(N);
+                llvm::SmallVector<Value, 8> Args;
+                for (unsigned i = 0; i != ArgRefs.size(); i++)
+                    Args.push_back(convert_value(interp(Nodes, ArgRefs[i], Frame, Self), Nodes[ArgRefs[i]].Type, Types[i]));
+                if (N.Tail && N.A == Self) {
+                    FnInfo &F = *Functions[Self];
+                    if (count_call(F, Self, Self)) { // Promoted meanwhile
+                        V.I = F.Entry(Args.data());
+                        break;
+                    }
+                    std::copy(Args.begin(), Args.end(), Frame);
+                    E = F.Root;
+                    continue;
+                }
+                V = call_function(N.A, Args.data(), Self);
+                break;
+            }
+            case IF_EXPR: {
+                Value C = convert_value(interp(Nodes, N.A, Frame, Self), Nodes[N.A].Type, T_BOOL);
+                E = C.I ? N.B : N.C;
+                continue;
+            }
+            case FOR_EXPR: {
+                auto Parts = Nodes.loop(N);
+                ValueType VarType = (ValueType)N.Op;
+                Value Start = convert_value(interp(Nodes, Parts[0], Frame, Self), Nodes[Parts[0]].Type, VarType);
+                Value End = convert_value(interp(Nodes, Parts[1], Frame, Self), Nodes[Parts[1]].Type, T_DOUBLE);
+                Value Step;
+                if (Parts[2]) Step = convert_value(interp(Nodes, Parts[2], Frame, Self), Nodes[Parts[2]].Type, VarType);
+                else if (VarType == T_INT) Step.I = 1;
+                else Step.D = 1.0;
+                Value StartD = convert_value(Start, VarType, T_DOUBLE), StepD = convert_value(Step, VarType, T_DOUBLE);
+                int64_t Trips = for_trip_count(StartD.D, End.D, StepD.D);
+                ValueType BodyType = Nodes[Parts[3]].Type;
+                if (N.Type == T_INT) V.I = 0;
+                else V.D = 0.0;
+                for (int64_t K = 0; K < Trips; K++) {
+                    if (VarType == T_INT) Frame[N.C].I = (int64_t)((uint64_t)Start.I + (uint64_t)K * (uint64_t)Step.I);
+                    else Frame[N.C].D = Start.D + (double)K * Step.D;
+                    Value B = convert_value(interp(Nodes, Parts[3], Frame, Self), BodyType, N.Type);
+                    if (N.Type == T_INT) V.I = (int64_t)((uint64_t)V.I + (uint64_t)B.I);
+                    else V.D += B.D;
+                }
+                break;
+            }
+            case SEQ_EXPR: {
+                auto Items = Nodes.args(N);
+                for (ExprRef Item : Items.drop_back()) interp(Nodes, Item, Frame, Self);
+                E = Items.back();
+                continue;
+            }
+            case LET_EXPR:
+            case ASSIGN_EXPR:
+                V = Frame[N.C] = convert_value(interp(Nodes, N.B, Frame, Self), Nodes[N.B].Type, N.Type);
+                break;
+            case INDEX_EXPR: {
+                Array *A = interp(Nodes, N.A, Frame, Self).A;
+                int64_t Index = convert_value(interp(Nodes, N.B, Frame, Self), Nodes[N.B].Type, T_INT).I;
+                if ((uint64_t)Index >= (uint64_t)A->Len) array_bounds_error(RUNTIME.get(), Index, A->Len);
+                V.D = A->Data[Index];
+                break;
+            }
+            case BUILTIN_EXPR:
+                V = interp_builtin(Nodes, N, Frame, Self);
+                break;
+        }
+        return convert_value(V, N.Type, Want);
+    }
+}
+
+
+
+//                   //
+// --- Promotion --- //
+//                   //
+
+// HELPER FUNCTION -- the function node E calls, directly or through map
+static SymbolID callee_of(const ExprArena &Nodes, ExprRef E) {
+    const ExprNode &N = Nodes[E];
+    if (N.Kind == CALL_EXPR) return N.A;
+    if (N.Kind == BUILTIN_EXPR && N.Op == B_MAP) return Nodes[Nodes.args(N)[0]].A;
+    return NO_SYMBOL;
+}
+
+// HELPER FUNCTION -- true if Nodes hold a for loop
+static bool has_loop(const ExprArena &Nodes) {
+    for (ExprRef E = 1; E <= Nodes.size(); E++)
+        if (Nodes[E].Kind == FOR_EXPR) return true;
+    return false;
+}
+
+// i64 __tier_<name>(i64 *Args) calls <name> with the unpacked array
+static bool codegen_trampoline(SymbolID Name) {
+    llvm::Function *Target = getFunction(Name);
+    if (!Target) return false;
+    const ProtoFn &P = *function_protos[Name];
+
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    llvm::FunctionType *FT = llvm::FunctionType::get(I64, {I64->getPointerTo()}, false);
+    llvm::Function *T = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+                                               "__tier_" + SYMBOLS.name(Name), MODULE.get());
+    BUILDER.SetInsertPoint(llvm::BasicBlock::Create(CONTEXT, "entry", T));
+
+    llvm::Value *Array = &*T->arg_begin();
+    llvm::SmallVector<llvm::Value *, 8> Args;
+    for (unsigned i = 0, e = Target->arg_size(); i != e; i++)
+        Args.push_back(from_slot(BUILDER.CreateLoad(BUILDER.CreateConstGEP1_32(Array, i), "arg"), P.getArgTypes()[i]));
+    BUILDER.CreateRet(to_slot(BUILDER.CreateCall(Target, Args, "retval"), P.getReturnType()));
+    return true;
+}
+
+// Compiles Root and every interpreted function it can reach
+static void promote(SymbolID Root) {
+    std::vector<bool> Seen(SYMBOLS.size());
+    std::vector<SymbolID> Work(1, Root), Closure;
+    Seen[Root] = true;
+    while (!Work.empty()) {
+        SymbolID Name = Work.back();
+        Work.pop_back();
+        FnInfo &F = *Functions[Name];
+        if (F.Entry) continue; // Native already, and so is everything it calls
+        Closure.push_back(Name);
+        for (ExprRef E = 1; E <= F.Body.size(); E++) {
+            SymbolID Callee = callee_of(F.Body, E);
+            if (Callee != NO_SYMBOL && !Seen[Callee]) {
+                Seen[Callee] = true;
+                Work.push_back(Callee);
+            }
+        }
+    }
+
+    // Promotion can happen in the middle of a batch, so build aside
+    auto SavedModule = std::move(MODULE);
+    auto SavedFunctions = std::move(ModuleFunctions);
+    initialize_module();
+
+    bool OK = true;
+    for (SymbolID Name : Closure) {
+        FnInfo &F = *Functions[Name];
+        if (!F.Import && !codegen_function(*function_protos[Name], F.Body, F.Root)) OK = false;
+        if (OK && !codegen_trampoline(Name)) OK = false;
+    }
+    if (OK) add_module(std::move(MODULE));
+
+    MODULE = std::move(SavedModule);
+    ModuleFunctions = std::move(SavedFunctions);
+
+    for (SymbolID Name : Closure) {
+        FnInfo &F = *Functions[Name];
+        if (!OK) {
+            F.NoJIT = true;
+            continue;
+        }
+        auto Sym = jit->findSymbol("__tier_" + SYMBOLS.name(Name).str());
+        F.Entry = (int64_t (*)(const Value *))(intptr_t)Sym.getAddress();
+    }
+}
+
+// Compiles every interpreted function Nodes call, so compiled code can call
+// them directly. False if one cannot be compiled.
+static bool compile_callees(const ExprArena &Nodes) {
+    for (ExprRef E = 1; E <= Nodes.size(); E++) {
+        SymbolID Callee = callee_of(Nodes, E);
+        if (Callee == NO_SYMBOL || !symbol_slot(Functions, Callee)) continue;
+        FnInfo &F = *Functions[Callee];
+        if (!F.Entry && !F.NoJIT) promote(Callee);
+        if (!F.Entry) {
+            log_error("Function could not be compiled.");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Counts a call of an interpreted function, true once it runs natively
+static bool count_call(FnInfo &F, SymbolID Callee, SymbolID Caller) {
+    if (!F.Entry && !F.NoJIT) {
+        if (Callee == Caller) ++F.Loops;
+        else ++F.Calls;
+        if (F.Import || F.HasLoop || F.Calls + F.Loops >= HotThreshold) promote(Callee);
+    }
+    return F.Entry != nullptr;
+}
+
+// Returns a value of the callee's return type
+static Value call_function(SymbolID Callee, const Value *Args, SymbolID Caller) {
+    FnInfo &F = *Functions[Callee];
+    Value V;
+    if (count_call(F, Callee, Caller)) {
+        V.I = F.Entry(Args);
+        return V;
+    }
+
+    MemoInfo *Memo = function_protos[Callee]->getMemoTable();
+    if (Memo && memo_lookup(*Memo, Args, V)) return V;
+
+    llvm::SmallVector<Value, 16> Frame(Args, Args + F.NumParams);
+    Frame.resize(F.NumSlots);
+    V = interp(F.Body, F.Root, Frame.data(), Callee);
+    V = convert_value(V, F.Body[F.Root].Type, function_protos[Callee]->getReturnType());
+    if (Memo) memo_store(*Memo, Args, V);
+    return V;
+}
+
+
+
+//                    //
+// --- Statements --- //
+//                    //
+
+// True if a definition other than Name's own calls it
+static bool has_callers(SymbolID Name) {
+    for (SymbolID Caller = 0; Caller != Functions.size(); Caller++) {
+        if (Caller == Name || !Functions[Caller]) continue;
+        const ExprArena &Body = Functions[Caller]->Body;
+        for (ExprRef E = 1; E <= Body.size(); E++)
+            if (callee_of(Body, E) == Name) return true;
+    }
+    return false;
+}
+
+// Callers' call nodes keep the arity, argument conversions and result type
+// they were checked against, so a function others call cannot change its
+// signature
+static bool keeps_signature(SymbolID Name, const ProtoFn *Old, const ProtoFn &New) {
+    if (!Old || !has_callers(Name)) return true;
+    if (Old->getArgs().size() != New.getArgs().size()) {
+        log_error("Cannot change the number of arguments of a function other definitions call.");
+        return false;
+    }
+    if (Old->getArgTypes() != New.getArgTypes() || Old->getReturnType() != New.getReturnType()) {
+        log_error("Cannot change the types of a function other definitions call.");
+        return false;
+    }
+    return true;
+}
+
+// Keeps the definition for the interpreter. On error the previous
+// definition of the name, if any, stays in place.
+static bool define_interpreted(FnExpression &Fn) {
+    auto Info = llvm::make_unique<FnInfo>();
+    Info->Body = AST;
+    Info->Root = Fn.getBody();
+    Info->NumParams = Fn.getProto().getArgs().size();
+    Info->HasLoop = has_loop(Info->Body);
+
+    SymbolID Name = Fn.getProto().getName();
+    auto OldProto = std::move(symbol_slot(function_protos, Name));
+    auto OldInfo = std::move(symbol_slot(Functions, Name));
+    function_protos[Name] = Fn.takeProto(); // Visible to its own body
+    Functions[Name] = std::move(Info);
+
+    FnInfo &F = *Functions[Name];
+    ProtoFn &P = *function_protos[Name];
+    if (check_body(&P, F.Body, F.Root, F.NumSlots) && keeps_signature(Name, OldProto.get(), P) && attach_memo(P)) {
+        fold_body(F.Body, F.Root);
+        return true;
+    }
+
+    function_protos[Name] = std::move(OldProto);
+    Functions[Name] = std::move(OldInfo);
+    return false;
+}
+
+static void define_import(SymbolID Name) {
+    auto Info = llvm::make_unique<FnInfo>();
+    Info->Import = true;
+    Info->NumParams = function_protos[Name]->getArgs().size();
+    symbol_slot(Functions, Name) = std::move(Info);
+}
+
+// Evaluates a top-level expression held in AST, as a double like compiled ones
+static bool eval_top(ExprRef E, double &Result) {
+    unsigned NumSlots;
+    if (!check_body(nullptr, AST, E, NumSlots)) return false;
+    if (fold_body(AST, E)) {
+        Result = convert_value(AST.value(AST[E]), AST[E].Type, T_DOUBLE).D;
+        return true;
+    }
+    StageScope Timing(STAGE_EXECUTE);
+    llvm::SmallVector<Value, 16> Frame(NumSlots);
+    Result = convert_value(interp(AST, E, Frame.data(), NO_SYMBOL), AST[E].Type, T_DOUBLE).D;
+    release_arrays();
+    return true;
+}
+
+#endif
@@ -3,24 +3,43 @@
 // Charles Timmerman - cttimm4427@ung.edu //
 // -------------------------------------- //
 
-#include "parser.h"
+#include "driver.h"
+
+static bool BatchMode = false; // Running a script file, no prompt
 
 static void MainLoop() {
     while(1) {
-        fprintf(stderr, "tlang > ");
+        if (!BatchMode) fprintf(stderr, "tlang > ");
+        StageScope Timing(STAGE_PARSE); // What the statement's handler does besides the other stages
         switch (currToken) {
             case _EOF:
+                flush_top();
                 return;
             case ';':
                 handle_return();
                 break;
             case _FN:
+                flush_top();
                 handle_definition();
                 break;
             case _IMPORT:
+                flush_top();
                 handle_import();
                 break;
+            case _MEMO:
+                flush_top();
+                handle_memo();
+                break;
+            case _STATS:
+                flush_top();
+                handle_stats();
+                break;
+            case _BENCH:
+                flush_top();
+                handle_bench();
+                break;
             case _EXIT:
+                flush_top();
                 fprintf(stderr, "exiting...\n");
                 return;
             default:
@@ -31,25 +50,69 @@ static void MainLoop() {
 }
 
 
-int main() {
+int main(int argc, char **argv) {
     
 
-    LLVMInitializeNativeTarget();
-    LLVMInitializeNativeAsmPrinter();
-    LLVMInitializeNativeAsmParser();
+    initialize_native();
+
+    llvm::SmallString<128> DefaultCache;
+    if (llvm::sys::path::user_cache_directory(DefaultCache, "tlang"))
+        CacheDir = DefaultCache.str().str();
+
+    // tlang [options] file.tl maps the script, otherwise read stdin
+    const char *Script = nullptr;
+    AotMode = llvm::sys::path::filename(argv[0]) == "tlangc";
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') Script = argv[i];
+        else if (!strcmp(argv[i], "-c")) AotMode = true;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) AotOutput = argv[++i];
+        else if (!parse_option(argv[i])) {
+            fprintf(stderr, "tlang: bad option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (AotMode) { // tlangc file.tl -o out.o|out.so, see aot.h
+        if (!Script || AotOutput.empty()) {
+            fprintf(stderr, "usage: tlangc [options] file.tl -o out.o|out.so\n");
+            return 1;
+        }
+        HotThreshold = 0;
+        CacheDir.clear();
+        MemoTablesInModule = true;
+    }
+    std::string VecLibError;
+    if (!load_vector_library(VecLibError)) {
+        fprintf(stderr, "tlang: cannot load libmvec: %s\n", VecLibError.c_str());
+        return 1;
+    }
+    if (!open_profile_outputs(Script)) return 1;
+    if (Script) {
+        if (!open_source(Script)) return 1;
+        BatchMode = true;
+    } else {
+        open_stdin();
+    }
+    // Scripts batch their top-level expressions; with a prompt, results
+    // have to come back as each line is read.
+    TopBatchLimit = TopBatchOption > 0 ? TopBatchOption : BatchMode ? 256 : 1;
 
     // Preparing shell and parser
-    fprintf(stderr, "tlang > ");
+    if (!BatchMode) fprintf(stderr, "tlang > ");
     get_next_token();
     
 
     // Memory allocation and initialization
     
-    jit = llvm::make_unique<llvm::orc::KaleidoscopeJIT>();
-    initialize_module();
+    start_jit();
     MainLoop();
+    if (AotMode) return compile_aot(Script) ? 0 : 1;
     // Dumps all messages upon closing with CTRL-D
     MODULE->print(llvm::errs(), nullptr);
+    if (TimeOpt) print_opt_timings();
+    if (TimeStages) print_stage_times();
+    if (!StagesJSON.empty() && !write_stage_json(StagesJSON, Script, OptLevel, HotThreshold)) return 1;
+    if (OBJCACHE)
+        fprintf(stderr, "object cache: %u hits, %u misses\n", OBJCACHE->hits(), OBJCACHE->misses());
 
     return 0;
 };
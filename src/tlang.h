@@ -4,7 +4,10 @@
 #ifndef TLANG_H
 #define TLANG_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
@@ -12,21 +15,46 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
-#include "llvm/IR/LegacyPassManager.h"
-#include "llvm/Transforms/Scalar.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/LCSSA.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "jit.h"
+#include "objcache.h"
+#include "mversion.h"
+#include "intrinsics.h"
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <unistd.h>
 
 
 
@@ -35,7 +63,15 @@
 <Program>       ::= <Statement>*
 <Statement>     ::= <FnExpression> | <Expression>
 <Expression>    ::= <NumExpression> | <VarExpression> | <CallExpression> | <OpExpression>
-<FnExpression>  ::= fn <ProtoFn><Expression>
+                  | <AssignExpression> | <Block> | <IndexExpression>
+<FnExpression>  ::= fn [fast] <Identifier><Params>[: <Type>] <Expression>
+<Params>        ::= (<Identifier>[: <Type>] [,]...)
+<Type>          ::= int | bool | double | array
+<IndexExpression> ::= (<VarExpression> | <CallExpression>)[<Expression>]...
+<ForExpression> ::= for <Identifier> = <Expression>, <Expression>[, <Expression>] <Expression>
+<Block>         ::= { <Item> [; <Item>]* [;] }
+<Item>          ::= let <Identifier> = <Expression> | <Expression>
+<AssignExpression> ::= <Identifier> := <Expression>
 <ProtoFn>       ::= <Identifier><Args>
 <Args>          ::= (<Expression>) | (<Expression>*)
 <OpExpression>  ::= <Expression><Op><Expression>
@@ -44,31 +80,120 @@
 <NumExpression> ::= <Number>
 */
 
-class Expression;
-class NumExpression;
-class VarExpression;
-class OpExpression;
-class CallExpression;
 class ProtoFn;
 class FnExpression;
-class IfExpression;
-class ForExpression;
+struct MemoInfo;
+class ExprArena;
+class SymbolTable;
+
+
+// --- Sessions ---
+// A session is a thread. All of the compiler's state below and in the other
+// headers (symbols, the LLVMContext with its builder and module, the JIT,
+// the lexer and parser, options and counters) is thread_local, so sessions
+// on different threads lex, parse, generate code and JIT compile without
+// sharing anything or taking a lock. The little that is process wide is set
+// up once (initialize_native) or locked (the perf files). What its code
+// needs at run time is the session's Runtime (array.h), which any thread can
+// call into: libtlang compiles every module before handing out its
+// functions, so they never reenter the JIT. The REPL's stubs compile on their
+// first call, in the session's context. tlang_close clears all of it, the
+// context included, so a thread's next session starts from nothing.
+
+// --- Symbols ---
+// Identifiers are interned once, by the lexer. Past that point a name is a
+// dense integer id, and scopes, prototypes and the current module's functions
+// are plain vectors indexed by it.
+
+typedef uint32_t SymbolID;
+
+class SymbolTable {
+    llvm::StringMap<SymbolID> Ids;
+    std::vector<llvm::StringRef> Names; // Keys owned by Ids
+public:
+    SymbolID intern(llvm::StringRef Name) {
+        auto R = Ids.insert(std::make_pair(Name, (SymbolID)Names.size()));
+        if (R.second) Names.push_back(R.first->getKey());
+        return R.first->second;
+    }
+    llvm::StringRef name(SymbolID Id) const { return Names[Id]; }
+    size_t size() const { return Names.size(); }
+};
+
+static thread_local SymbolTable SYMBOLS;
+static const SymbolID NO_SYMBOL = ~0u;
+
+// HELPER FUNCTION -- grows an id indexed table to cover every interned symbol
+template <typename T> static T &symbol_slot(std::vector<T> &Table, SymbolID Id) {
+    if (Id >= Table.size()) Table.resize(SYMBOLS.size());
+    return Table[Id];
+}
+
+
+// --- Types ---
+// Values are doubles, 64-bit integers, bools or arrays. Integer literals are
+// ints, and scalar types only ever widen, bool < int < double: arithmetic
+// promotes bools to int, '/' always divides doubles and comparisons give
+// bools. Parameters and imports without a type are doubles, as every value
+// was before. Arrays never convert to or from a scalar.
+
+enum ValueType : uint8_t { T_NONE, T_BOOL, T_INT, T_DOUBLE, T_ARRAY }; // T_NONE: not inferred yet
+
+// An array is a length and a pointer to contiguous doubles, which may be
+// memory the host owns. Programs only read arrays, so the host's data is
+// used in place, never copied.
+struct Array {
+    double *Data;
+    int64_t Len;
+};
+
+union Value { // Bools are held in I as 0 or 1
+    double D;
+    int64_t I;
+    Array *A;
+};
+
+static ValueType join_types(ValueType A, ValueType B) { return A > B ? A : B; }
+static ValueType arith_type(ValueType T) { return join_types(T, T_INT); }
+// True when a From value can be used where a To is expected
+static bool fits(ValueType From, ValueType To) {
+    return From == To || From == T_NONE || (From < To && To != T_ARRAY);
+}
+
+static const char *type_name(ValueType T) {
+    switch (T) {
+        case T_BOOL: return "bool";
+        case T_INT: return "int";
+        case T_ARRAY: return "array";
+        default: return "double";
+    }
+}
 
 
 // ---  Code Generation --- 
 
-static llvm::LLVMContext CONTEXT;
-static llvm::IRBuilder<> BUILDER(CONTEXT);
-static std::unique_ptr<llvm::legacy::FunctionPassManager> FPM;
-static std::unique_ptr<llvm::Module> MODULE;
-static std::map<std::string, llvm::Value *> NamedValues;
+static thread_local llvm::LLVMContext CONTEXT;
+static thread_local llvm::IRBuilder<> BUILDER(CONTEXT);
+struct Optimizer;
+static thread_local std::unique_ptr<Optimizer> OPT;
+static thread_local std::unique_ptr<llvm::Module> MODULE;
+static thread_local std::vector<llvm::AllocaInst *> NamedValues;     // By SymbolID, stack slot, null when unbound
 llvm::Value *log_errorv(const char *Str);
-static std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
-static std::map<std::string, std::unique_ptr<ProtoFn>> function_protos;
+static thread_local std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+static thread_local std::unique_ptr<DiskObjectCache> OBJCACHE;             // Null when disabled
+static thread_local std::vector<std::unique_ptr<ProtoFn>> function_protos; // By SymbolID
+static thread_local std::vector<llvm::Function *> ModuleFunctions;        // By SymbolID, declarations in MODULE
+static thread_local bool ModuleHasDefinitions = false;                    // MODULE holds definitions not yet in the JIT
 // --- Error functions ---
 
-std::unique_ptr<Expression> log_error();
-std::unique_ptr<ProtoFn> log_errorp();
+typedef uint32_t ExprRef;
+ExprRef log_error(const char *Str);
+
+// While a batch of top-level expressions is pending, diagnostics are held
+// back and printed with the batch, so output keeps the order of the source.
+static thread_local bool DeferDiagnostics = false;
+static thread_local std::string DeferredDiagnostics;
+std::unique_ptr<ProtoFn> log_errorp(const char *Str);
 
 
 
@@ -77,87 +202,182 @@ std::unique_ptr<ProtoFn> log_errorp();
 // --   Parse Tree Nodes   -- //
 //                            //
 
-class Expression {
-    public:
-        virtual ~Expression() {}
-        virtual llvm::Value *codegen() = 0;
-};
+// Expressions are not separate heap objects. Every node of the statement being
+// parsed is a 16 byte record in one flat arena and children are referenced by
+// index. Ref 0 is the null expression, so a failed parse still tests false.
+// The arena is reset (keeping its capacity) once the statement is handled.
 
-class NumExpression : public Expression {
-    double Val;
-public:
-    NumExpression(double Val) : Val(Val) {}
-    virtual llvm::Value *codegen();
+enum ExprKind : uint8_t {
+    NUM_EXPR,   // A = constant index
+    VAR_EXPR,   // A = SymbolID
+    OP_EXPR,    // Op, A = left side, B = right side
+    CALL_EXPR,  // A = callee SymbolID, B = first argument ref, C = argument count
+    IF_EXPR,    // A = condition, B = body, C = else
+    FOR_EXPR,   // A = variable SymbolID, B = first of start, end, step, body refs, C = slot
+    SEQ_EXPR,   // B = first item ref, C = item count; the value is the last item's
+    LET_EXPR,   // A = SymbolID, B = initializer, C = slot; in scope until the block ends
+    ASSIGN_EXPR, // A = SymbolID, B = value, C = slot
+    INDEX_EXPR,  // A = array, B = index
+    BUILTIN_EXPR // Op = Builtin, B = first argument ref, C = argument count; a call the resolver bound to a builtin
 };
 
-class VarExpression : public Expression {
-    std::string Name;
-public:
-    VarExpression(const std::string &Name) : Name(Name) {}
-    llvm::Value *codegen() override;
+struct ExprNode {
+    ExprKind Kind;
+    char Op;        // Operator; for a FOR_EXPR the loop variable's type, for a BUILTIN_EXPR which one
+    bool Tail;      // Call in tail position, see mark_tail_calls
+    ValueType Type; // Set for literals by the parser, for the rest by check_body
+    uint32_t A, B, C;
 };
 
-class OpExpression : public Expression {
-    char Op;
-    std::unique_ptr<Expression> leftSide, rightSide;
-public:
-    OpExpression(char op, std::unique_ptr<Expression> leftSide,
-            std::unique_ptr<Expression> rightSide)
-            : Op(op), leftSide(std::move(leftSide)), rightSide(std::move(rightSide)) {}
-    llvm::Value *codegen() override;
-};
+class ExprArena {
+    std::vector<ExprNode> Nodes;
+    std::vector<ExprRef> ArgRefs;
+    std::vector<Value> Consts;
 
-class CallExpression : public Expression {
-    std::string Callee;
-    std::vector<std::unique_ptr<Expression>> Args;
+    ExprRef add(ExprKind Kind, char Op, uint32_t A, uint32_t B, uint32_t C) {
+        Nodes.push_back(ExprNode{Kind, Op, false, T_NONE, A, B, C});
+        ++Counters.Nodes;
+        return Nodes.size() - 1;
+    }
 public:
-    CallExpression(const std::string &Callee,
-            std::vector<std::unique_ptr<Expression>> Args)
-            : Callee(Callee), Args(std::move(Args)) {}
-    llvm::Value *codegen() override;
+    ExprArena() { reset(); }
+
+    void reset() {
+        Nodes.clear();
+        ArgRefs.clear();
+        Consts.clear();
+        Nodes.push_back(ExprNode{NUM_EXPR, 0, false, T_NONE, 0, 0, 0}); // null ref
+    }
+
+    ExprRef num(Value Val, ValueType Type) {
+        Consts.push_back(Val);
+        ExprRef E = add(NUM_EXPR, 0, Consts.size() - 1, 0, 0);
+        Nodes[E].Type = Type;
+        return E;
+    }
+    // Rewrites R into a literal of its type, see fold.h
+    void make_constant(ExprRef R, Value Val) {
+        Consts.push_back(Val);
+        Nodes[R].Kind = NUM_EXPR;
+        Nodes[R].A = Consts.size() - 1;
+    }
+    ExprRef var(SymbolID Name) { return add(VAR_EXPR, 0, Name, 0, 0); }
+    ExprRef op(char Op, ExprRef L, ExprRef R) { return add(OP_EXPR, Op, L, R, 0); }
+    ExprRef call(SymbolID Callee, llvm::ArrayRef<ExprRef> Args) {
+        uint32_t First = ArgRefs.size();
+        ArgRefs.insert(ArgRefs.end(), Args.begin(), Args.end());
+        return add(CALL_EXPR, 0, Callee, First, Args.size());
+    }
+    ExprRef ifexpr(ExprRef Cond, ExprRef Body, ExprRef Else) { return add(IF_EXPR, 0, Cond, Body, Else); }
+    ExprRef forexpr(SymbolID Var, ExprRef Start, ExprRef End, ExprRef Step, ExprRef Body) {
+        uint32_t First = ArgRefs.size();
+        ExprRef Parts[] = {Start, End, Step, Body}; // Step 0 when omitted
+        ArgRefs.insert(ArgRefs.end(), Parts, Parts + 4);
+        return add(FOR_EXPR, 0, Var, First, 0);
+    }
+
+    const ExprNode &operator[](ExprRef R) const { return Nodes[R]; }
+    ExprNode &at(ExprRef R) { return Nodes[R]; }
+    Value value(const ExprNode &N) const { return Consts[N.A]; }
+    llvm::ArrayRef<ExprRef> args(const ExprNode &N) const {
+        return llvm::ArrayRef<ExprRef>(ArgRefs.data() + N.B, N.C);
+    }
+    ExprRef seq(llvm::ArrayRef<ExprRef> Items) {
+        uint32_t First = ArgRefs.size();
+        ArgRefs.insert(ArgRefs.end(), Items.begin(), Items.end());
+        return add(SEQ_EXPR, 0, 0, First, Items.size());
+    }
+    ExprRef let(SymbolID Name, ExprRef Init) { return add(LET_EXPR, 0, Name, Init, 0); }
+    ExprRef assign(SymbolID Name, ExprRef Value) { return add(ASSIGN_EXPR, 0, Name, Value, 0); }
+    ExprRef index(ExprRef Array, ExprRef Index) { return add(INDEX_EXPR, 0, Array, Index, 0); }
+
+    llvm::ArrayRef<ExprRef> loop(const ExprNode &N) const {
+        return llvm::ArrayRef<ExprRef>(ArgRefs.data() + N.B, 4);
+    }
+    size_t size() const { return Nodes.size() - 1; }
 };
 
+// A call is in tail position when its value is the function's value: the
+// body itself, either branch of an if in tail position, or the last item of
+// a block in tail position. Loop bodies and operands never are.
+static void mark_tail_calls(ExprArena &Nodes, ExprRef E) {
+    ExprNode &N = Nodes.at(E);
+    if (N.Kind == CALL_EXPR) N.Tail = true;
+    if (N.Kind == IF_EXPR) {
+        mark_tail_calls(Nodes, N.B);
+        mark_tail_calls(Nodes, N.C);
+    }
+    if (N.Kind == SEQ_EXPR) mark_tail_calls(Nodes, Nodes.args(N).back());
+}
+
+// Arena for the statement currently being parsed
+static thread_local ExprArena AST;
+// Arena being code generated, AST or a definition kept by the interpreter tier
+static thread_local const ExprArena *NODES = &AST;
+
 class ProtoFn {
-    std::string Name;
-    std::vector<std::string> Args;
+    SymbolID Name;
+    std::vector<SymbolID> Args;
+    std::vector<ValueType> ArgTypes;
+    ValueType RetType = T_NONE; // Inferred from the body unless declared
+    bool RetDeclared = false;
+    bool Fast; // fn fast name(...), relaxed floating point
+    llvm::Intrinsic::ID Intrinsic = llvm::Intrinsic::not_intrinsic; // Imports of libm functions, see intrinsics.h
+    bool Memo = false;           // fn memo name(...)
+    MemoInfo *MemoTab = nullptr; // Its result table, see memo.h
 public:
-    ProtoFn(const std::string &name, std::vector<std::string> Args)
-        : Name(name), Args(std::move(Args)) {}
+    ProtoFn(SymbolID name, std::vector<SymbolID> Args, bool Fast = false)
+        : Name(name), Args(std::move(Args)), ArgTypes(this->Args.size(), T_DOUBLE), Fast(Fast) {}
     llvm::Function *codegen();
-    const std::string &getName() const { return Name; }
+    SymbolID getName() const { return Name; }
+    llvm::ArrayRef<SymbolID> getArgs() const { return Args; }
+    llvm::ArrayRef<ValueType> getArgTypes() const { return ArgTypes; }
+    void setArgTypes(std::vector<ValueType> Types) { ArgTypes = std::move(Types); }
+    ValueType getReturnType() const { return RetType; }
+    void setReturnType(ValueType T) { RetType = T; }
+    bool hasDeclaredReturn() const { return RetDeclared; }
+    void declareReturn(ValueType T) {
+        RetType = T;
+        RetDeclared = true;
+    }
+    bool isFast() const { return Fast; }
+    llvm::Intrinsic::ID getIntrinsic() const { return Intrinsic; }
+    void setIntrinsic(llvm::Intrinsic::ID ID) { Intrinsic = ID; }
+    bool isMemo() const { return Memo; }
+    void setMemo(bool M) { Memo = M; }
+    MemoInfo *getMemoTable() const { return MemoTab; }
+    void setMemoTable(MemoInfo *Table) { MemoTab = Table; }
 
 };
 
 class FnExpression {
     std::unique_ptr<ProtoFn> Proto;
-    std::unique_ptr<Expression> Body;
+    ProtoFn *Checked = nullptr; // In function_protos once check() passed
+    ExprRef Body; // Root of the body in AST
 public:
-    FnExpression(std::unique_ptr<ProtoFn> Proto,
-           std::unique_ptr<Expression> Body)
-           : Proto(std::move(Proto)), Body(std::move(Body)) {}
+    FnExpression(std::unique_ptr<ProtoFn> Proto, ExprRef Body)
+           : Proto(std::move(Proto)), Body(Body) {}
     
+    bool check();
     llvm::Function *codegen();
-
-};
-
-class IfExpression : public Expression { 
-    std::unique_ptr<Expression> cond, body, xelse;
-public:
-    IfExpression(std::unique_ptr<Expression> cond, std::unique_ptr<Expression> body, std::unique_ptr<Expression> xelse)
-    : cond(std::move(cond)), body(std::move(body)), xelse(std::move(xelse)) {}
-    llvm::Value *codegen() override;
-};
-
-class ForExpression {
+    const ProtoFn &getProto() const { return *Proto; }
+    std::unique_ptr<ProtoFn> takeProto() { return std::move(Proto); }
+    ExprRef getBody() const { return Body; }
 
 };
 // -- End Nodes
 
 
 // Error handling functions
-std::unique_ptr<Expression> log_error(const char *Str) {
+ExprRef log_error(const char *Str) {
+    if (DeferDiagnostics) {
+        DeferredDiagnostics += "log_error: ";
+        DeferredDiagnostics += Str;
+        DeferredDiagnostics += "\n";
+        return 0;
+    }
     fprintf(stderr, "log_error: %s\n", Str);
-    return nullptr;
+    return 0;
 }
 std::unique_ptr<ProtoFn> log_errorp(const char *Str) {
     log_error(Str);
@@ -170,14 +390,13 @@ std::unique_ptr<ProtoFn> log_errorp(const char *Str) {
 // --- Code Generator --- //
 //                        //
 
-// These all override the codegen routine from the parse tree node_destruct
+// One routine per node kind, dispatched from codegen_expr
 
 
-llvm::Function *getFunction(std::string Name) {
-	if (auto *F = MODULE->getFunction(Name)) return F;
+llvm::Function *getFunction(SymbolID Name) {
+	if (auto *F = symbol_slot(ModuleFunctions, Name)) return F;
 
-	auto FI = function_protos.find(Name);
-	if (FI !=function_protos.end()) return FI->second->codegen();
+	if (auto &P = symbol_slot(function_protos, Name)) return P->codegen();
 
 	return nullptr;
 }
@@ -187,22 +406,170 @@ llvm::Value *log_errorv(const char *Str) {
     return nullptr;
 }
 
-llvm::Value *NumExpression::codegen() {
-    return llvm::ConstantFP::get(CONTEXT, llvm::APFloat(Val));
+static llvm::Value *codegen_expr(ExprRef E);
+static void optimize_function(llvm::Function &F);
+static void set_fp_semantics(llvm::Function &F, bool Fast);
+static llvm::Value *fp_compare(llvm::Value *Cmp);
+static thread_local bool FunctionHasLoops = false; // Set while generating a body with a for
+
+// --- Tail calls ---
+// Calls in tail position never grow the stack. A self tail call stores the
+// new arguments in the parameters' slots and branches back to the top of the body,
+// whatever the optimization level. Any other tail call is emitted as
+// call + ret, musttail when the signatures match so the backend has to turn
+// it into a jump. Either way the block ends there: the call's value is
+// undef and codegen_if leaves such a branch out of its phi.
+struct TailLoop {
+    llvm::Function *Function = nullptr;    // Being generated
+    llvm::BasicBlock *Header = nullptr;    // Null when the body has no self tail call
+    llvm::SmallVector<llvm::AllocaInst *, 8> Params;
+};
+static thread_local TailLoop TAILLOOP;
+
+static bool has_self_tail_call(const ExprArena &Nodes, SymbolID Name) {
+    for (ExprRef E = 1; E <= Nodes.size(); E++)
+        if (Nodes[E].Kind == CALL_EXPR && Nodes[E].Tail && Nodes[E].A == Name) return true;
+    return false;
 }
+static llvm::Function *codegen_function(const ProtoFn &P, const ExprArena &Nodes, ExprRef Body);
+static bool check_body(ProtoFn *P, ExprArena &Nodes, ExprRef Root, unsigned &NumSlots);
+static llvm::Value *codegen_index(const ExprNode &N);   // array.h
+static llvm::Value *codegen_builtin(const ExprNode &N); // array.h
+static bool fold_body(ExprArena &Nodes, ExprRef Root);                    // fold.h
+static bool attach_memo(ProtoFn &P);                                     // memo.h
+static llvm::Function *memoize(llvm::Function &F, const ProtoFn &P);     // memo.h
+
+static thread_local llvm::StructType *ArrayStruct = nullptr; // In CONTEXT, made on first use
 
-llvm::Value *VarExpression::codegen() {
-    llvm::Value *V = NamedValues[Name];
+// HELPER FUNCTION -- %array = { double*, i64 }, laid out as struct Array
+static llvm::StructType *array_struct() {
+    if (!ArrayStruct)
+        ArrayStruct = llvm::StructType::create(
+            CONTEXT, {llvm::Type::getDoublePtrTy(CONTEXT), llvm::Type::getInt64Ty(CONTEXT)}, "array");
+    return ArrayStruct;
+}
+
+// HELPER FUNCTION -- LLVM type of a value type
+static llvm::Type *llvm_type(ValueType T) {
+    switch (T) {
+        case T_BOOL: return llvm::Type::getInt1Ty(CONTEXT);
+        case T_INT: return llvm::Type::getInt64Ty(CONTEXT);
+        case T_ARRAY: return array_struct()->getPointerTo();
+        default: return llvm::Type::getDoubleTy(CONTEXT);
+    }
+}
+
+// Converts between value types. Checking only lets widening through, and
+// narrowing to bool for conditions.
+static llvm::Value *convert(llvm::Value *V, ValueType From, ValueType To) {
+    if (From == To || From == T_NONE || To == T_NONE) return V;
+    switch (To) {
+        case T_BOOL:
+            if (From == T_INT) return BUILDER.CreateICmpNE(V, llvm::ConstantInt::get(V->getType(), 0), "TOBOOL");
+            return fp_compare(BUILDER.CreateFCmpONE(V, llvm::ConstantFP::get(CONTEXT, llvm::APFloat(0.0)), "TOBOOL"));
+        case T_INT:
+            if (From == T_BOOL) return BUILDER.CreateZExt(V, llvm_type(T_INT), "TOINT");
+            return BUILDER.CreateFPToSI(V, llvm_type(T_INT), "TOINT");
+        default:
+            if (From == T_BOOL) return BUILDER.CreateUIToFP(V, llvm_type(T_DOUBLE), "TODOUBLE");
+            return BUILDER.CreateSIToFP(V, llvm_type(T_DOUBLE), "TODOUBLE");
+    }
+}
+
+// Moves a value between its type and the bits of a 64-bit slot, as held
+// in a Value: tier trampolines and memo tables store them this way
+static llvm::Value *to_slot(llvm::Value *V, ValueType T) {
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    if (T == T_DOUBLE) return BUILDER.CreateBitCast(V, I64);
+    if (T == T_ARRAY) return BUILDER.CreatePtrToInt(V, I64);
+    return T == T_BOOL ? BUILDER.CreateZExt(V, I64) : V;
+}
+
+static llvm::Value *from_slot(llvm::Value *V, ValueType T) {
+    if (T == T_DOUBLE) return BUILDER.CreateBitCast(V, llvm_type(T_DOUBLE));
+    if (T == T_ARRAY) return BUILDER.CreateIntToPtr(V, llvm_type(T_ARRAY));
+    return T == T_BOOL ? BUILDER.CreateTrunc(V, llvm_type(T_BOOL)) : V;
+}
+
+// HELPER FUNCTION -- emits E converted to T
+static llvm::Value *codegen_as(ExprRef E, ValueType T) {
+    llvm::Value *V = codegen_expr(E);
+    return V ? convert(V, (*NODES)[E].Type, T) : nullptr;
+}
+
+static llvm::Value *codegen_num(const ExprNode &N) {
+    if (N.Type != T_DOUBLE) return llvm::ConstantInt::get(llvm_type(N.Type), NODES->value(N).I, true); // Folded compares are bools
+    return llvm::ConstantFP::get(CONTEXT, llvm::APFloat(NODES->value(N).D));
+}
+
+// --- Variables ---
+// Every variable (parameters, loop variables and lets) lives in a stack slot
+// allocated in the entry block, and is read and written with loads and stores.
+// SROA (mem2reg at -O0) turns the slots back into SSA registers, so locals
+// cost nothing once optimized.
+
+static llvm::AllocaInst *create_entry_alloca(llvm::Function *F, llvm::StringRef Name, ValueType T) {
+    llvm::IRBuilder<> Entry(&F->getEntryBlock(), F->getEntryBlock().begin());
+    return Entry.CreateAlloca(llvm_type(T), nullptr, Name);
+}
+
+static llvm::Value *codegen_var(const ExprNode &N) {
+    llvm::AllocaInst *V = symbol_slot(NamedValues, N.A);
     if(!V)
-        log_errorv("Unknown variable name.");
+        return log_errorv("Unknown variable name.");
+    return BUILDER.CreateLoad(V, SYMBOLS.name(N.A));
+}
+
+static llvm::Value *codegen_let(const ExprNode &N) {
+    llvm::Value *Init = codegen_as(N.B, N.Type);
+    if (!Init) return nullptr;
+    llvm::AllocaInst *Slot = create_entry_alloca(BUILDER.GetInsertBlock()->getParent(), SYMBOLS.name(N.A), N.Type);
+    BUILDER.CreateStore(Init, Slot);
+    symbol_slot(NamedValues, N.A) = Slot; // The enclosing block restores the shadowed binding
+    return Init;
+}
+
+static llvm::Value *codegen_assign(const ExprNode &N) {
+    llvm::AllocaInst *Slot = symbol_slot(NamedValues, N.A);
+    if (!Slot) return log_errorv("Unknown variable name.");
+    llvm::Value *V = codegen_as(N.B, N.Type);
+    if (!V) return nullptr;
+    BUILDER.CreateStore(V, Slot);
     return V;
 }
 
-llvm::Value *OpExpression::codegen() {
-    llvm::Value *L = leftSide->codegen();
-    llvm::Value *R = rightSide->codegen();
+static llvm::Value *codegen_seq(const ExprNode &N) {
+    llvm::SmallVector<std::pair<SymbolID, llvm::AllocaInst *>, 4> Shadowed;
+    llvm::Value *V = nullptr;
+    for (ExprRef Item : NODES->args(N)) {
+        const ExprNode &I = (*NODES)[Item];
+        if (I.Kind == LET_EXPR) Shadowed.push_back(std::make_pair(I.A, symbol_slot(NamedValues, I.A)));
+        if (!(V = codegen_expr(Item))) break;
+    }
+    for (auto It = Shadowed.rbegin(); It != Shadowed.rend(); ++It) // Leave scope
+        NamedValues[It->first] = It->second;
+    return V;
+}
+
+// Operands are brought to a common type first: int when both are ints or
+// bools, double otherwise or for '/'. Comparisons give an i1.
+static llvm::Value *codegen_op(const ExprNode &N) {
+    ValueType T = N.Op == '/' ? T_DOUBLE : arith_type(join_types((*NODES)[N.A].Type, (*NODES)[N.B].Type));
+    llvm::Value *L = codegen_as(N.A, T);
+    llvm::Value *R = codegen_as(N.B, T);
     if(!L || !R) return nullptr;
-    switch(Op) {
+    if (T == T_INT) {
+        switch(N.Op) {
+            case '+': return BUILDER.CreateAdd(L, R, "ADDOP");
+            case '-': return BUILDER.CreateSub(L, R, "SUBOP");
+            case '*': return BUILDER.CreateMul(L, R, "MULOP");
+            case '<': return BUILDER.CreateICmpSLT(L, R, "CMPLT");
+            case '>': return BUILDER.CreateICmpSGT(L, R, "CMPGT");
+            case '=': return BUILDER.CreateICmpEQ(L, R, "CMPEQ");
+            default: return log_errorv("Invalid binary operator.");
+        }
+    }
+    switch(N.Op) {
         // Switch to generate opcode for IR
         case '+':
             return BUILDER.CreateFAdd(L, R, "ADDOP");
@@ -213,79 +580,154 @@ llvm::Value *OpExpression::codegen() {
         case '/':
             return BUILDER.CreateFDiv(L, R, "DIVOP");
         case '<':
-            L = BUILDER.CreateFCmpULT(L, R, "CMPLT");
-            return BUILDER.CreateUIToFP(L, llvm::Type::getDoubleTy(CONTEXT), "BOOLTMP");
+            return fp_compare(BUILDER.CreateFCmpULT(L, R, "CMPLT"));
         case '>':
-            L = BUILDER.CreateFCmpUGT(L, R, "CMPGT");
-            return BUILDER.CreateUIToFP(L, llvm::Type::getDoubleTy(CONTEXT), "BOOLTMP");
+            return fp_compare(BUILDER.CreateFCmpUGT(L, R, "CMPGT"));
         case '=':
-            L = BUILDER.CreateFCmpUEQ(L, R, "CMPEQ");
-            return BUILDER.CreateUIToFP(L, llvm::Type::getDoubleTy(CONTEXT), "BOOLTMP");
+            return fp_compare(BUILDER.CreateFCmpUEQ(L, R, "CMPEQ"));
         default:
             return log_errorv("Invalid binary operator.");
     }
 }
 
-llvm::Value *CallExpression::codegen() {
-    llvm::Function *callee = getFunction(Callee); 
-    if(!callee) return log_errorv("Unknown function referenced.");
+// HELPER FUNCTION -- calls the intrinsic an import of P maps to, see intrinsics.h
+static llvm::Value *codegen_intrinsic(const ProtoFn &P, llvm::ArrayRef<llvm::Value *> Args) {
+    llvm::Module *M = BUILDER.GetInsertBlock()->getModule();
+    llvm::Function *F = llvm::Intrinsic::getDeclaration(M, P.getIntrinsic(), {llvm::Type::getDoubleTy(CONTEXT)});
+    return BUILDER.CreateCall(F, Args, "retval");
+}
+
+static llvm::Value *codegen_call(const ExprNode &N) {
+    const ProtoFn &P = *function_protos[N.A];
+    bool Intrinsic = P.getIntrinsic() != llvm::Intrinsic::not_intrinsic;
+    llvm::Function *callee = Intrinsic ? nullptr : getFunction(N.A); // Intrinsics need no declaration
+    if(!Intrinsic && !callee) return log_errorv("Unknown function referenced.");
 
-    if(callee->arg_size() != Args.size()) return log_errorv("Incorrect number of arguments.");
+    auto Args = NODES->args(N);
+    if(P.getArgs().size() != Args.size()) return log_errorv("Incorrect number of arguments.");
 
-    std::vector<llvm::Value *> args;
+    auto Types = P.getArgTypes();
+    llvm::SmallVector<llvm::Value *, 8> args;
     for(unsigned i = 0, e = Args.size(); i != e; i++) {
-        args.push_back(Args[i]->codegen());
+        args.push_back(codegen_as(Args[i], Types[i]));
         if(!args.back()) return nullptr;
     }
-    return BUILDER.CreateCall(callee, args, "retval");
+    if (Intrinsic) return codegen_intrinsic(P, args); // Never a tail call, it is a value
+    // A tail call has to return what the caller returns
+    if (!N.Tail || callee->getReturnType() != TAILLOOP.Function->getReturnType())
+        return BUILDER.CreateCall(callee, args, "retval");
+
+    llvm::Value *Undef = llvm::UndefValue::get(callee->getReturnType());
+    if (callee == TAILLOOP.Function && TAILLOOP.Header) {
+        for (unsigned i = 0, e = args.size(); i != e; i++)
+            BUILDER.CreateStore(args[i], TAILLOOP.Params[i]);
+        BUILDER.CreateBr(TAILLOOP.Header);
+        return Undef;
+    }
+    llvm::CallInst *Call = BUILDER.CreateCall(callee, args, "retval");
+    Call->setTailCallKind(callee->getFunctionType() == TAILLOOP.Function->getFunctionType()
+                              ? llvm::CallInst::TCK_MustTail
+                              : llvm::CallInst::TCK_Tail);
+    BUILDER.CreateRet(Call);
+    return Undef;
 }
 
 llvm::Function *ProtoFn::codegen() {
-    std::vector<llvm::Type *> Doubles(Args.size(), llvm::Type::getDoubleTy(CONTEXT));
-    llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(CONTEXT), Doubles, false);
-    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, MODULE.get());
+    std::vector<llvm::Type *> Types;
+    for (ValueType T : ArgTypes) Types.push_back(llvm_type(T));
+    llvm::FunctionType *FT = llvm::FunctionType::get(llvm_type(RetType), Types, false);
+    llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, SYMBOLS.name(Name), MODULE.get());
+    if (RetType == T_BOOL) // C callers (libtlang, tlangc) read a returned bool as a zero extended byte
+        F->addAttribute(llvm::AttributeSet::ReturnIndex, llvm::Attribute::ZExt);
 
     unsigned Idx = 0;
-    for (auto &Arg : F->args()) Arg.setName(Args[Idx++]);
+    for (auto &Arg : F->args()) Arg.setName(SYMBOLS.name(Args[Idx++]));
+    symbol_slot(ModuleFunctions, Name) = F;
     return F;
 }
 
+// Registers the prototype, then checks and folds the body
+bool FnExpression::check() {
+    auto &P = *Proto;
+    symbol_slot(function_protos, P.getName()) = std::move(Proto);
+    unsigned NumSlots;
+    if (!check_body(&P, AST, Body, NumSlots) || !attach_memo(P)) return false;
+    fold_body(AST, Body);
+    Checked = &P;
+    return true;
+}
+
 llvm::Function *FnExpression::codegen() {
- ;
+    if (!Checked && !check()) return nullptr;
+    return codegen_function(*Checked, AST, Body);
+}
 
-    auto &P = *Proto;
-    function_protos[Proto->getName()] = std::move(Proto);
+// Emits the body of P from the nodes in Nodes
+static llvm::Function *codegen_function(const ProtoFn &P, const ExprArena &Nodes, ExprRef Body) {
+    StageScope Timing(STAGE_CODEGEN);
     llvm::Function *function = getFunction(P.getName());
     
     if(!function) return nullptr;
+    ++Counters.Functions;
+
+    NODES = &Nodes;
+    set_fp_semantics(*function, P.isFast());
+    FunctionHasLoops = false;
 
     llvm::BasicBlock *BB = llvm::BasicBlock::Create(CONTEXT, "entry", function);
     BUILDER.SetInsertPoint(BB);
 
-    NamedValues.clear();
-    for(auto &Arg : function->args())
-        NamedValues[Arg.getName()] = &Arg;
+    // Parameters are stored to their slots on entry
+    TAILLOOP.Function = function;
+    TAILLOOP.Header = nullptr;
+    TAILLOOP.Params.clear();
+    auto Params = P.getArgs();
+    unsigned Idx = 0;
+    for(auto &Arg : function->args()) {
+        llvm::AllocaInst *Slot = create_entry_alloca(function, Arg.getName(), P.getArgTypes()[Idx]);
+        BUILDER.CreateStore(&Arg, Slot);
+        TAILLOOP.Params.push_back(Slot);
+        symbol_slot(NamedValues, Params[Idx++]) = Slot;
+    }
+
+    // Self tail calls store new arguments and jump back here
+    if (has_self_tail_call(Nodes, P.getName())) {
+        TAILLOOP.Header = llvm::BasicBlock::Create(CONTEXT, "TAILLOOP", function);
+        BUILDER.CreateBr(TAILLOOP.Header);
+        BUILDER.SetInsertPoint(TAILLOOP.Header);
+    }
+
+    llvm::Value *retval = codegen_expr(Body);
 
-    if (llvm::Value *retval = Body->codegen()) {
-        BUILDER.CreateRet(retval);
+    for (SymbolID Param : Params) NamedValues[Param] = nullptr; // Leave scope
+    NODES = &AST;
 
+    if (retval) {
+        if (!BUILDER.GetInsertBlock()->getTerminator()) // Ends in a tail call otherwise
+            BUILDER.CreateRet(convert(retval, Nodes[Body].Type, P.getReturnType()));
+
+        if (P.getMemoTable()) { // The body moves out, behind the table lookup
+            llvm::Function *Inner = memoize(*function, P);
+            llvm::verifyFunction(*Inner);
+            optimize_function(*Inner);
+            FunctionHasLoops = false;
+        }
         llvm::verifyFunction(*function);
 
-	FPM->run(*function);
+	optimize_function(*function);
 
         return function;
     }
 
+    ModuleFunctions[P.getName()] = nullptr;
     function->eraseFromParent();
     return nullptr;
 }
 
-llvm::Value *IfExpression::codegen() {
-    llvm::Value *condv =  cond->codegen();
+static llvm::Value *codegen_if(const ExprNode &N) {
+    llvm::Value *condv = codegen_as(N.A, T_BOOL); // An i1 comparison is used as is
     if(!condv) return nullptr;
 
-    condv = BUILDER.CreateFCmpONE(condv, llvm::ConstantFP::get(CONTEXT, llvm::APFloat(0.0)), "IFCOND");
-
     llvm::Function *function = BUILDER.GetInsertBlock()->getParent();
 
     llvm::BasicBlock *bodyblock = llvm::BasicBlock::Create(CONTEXT, "IFBODY", function);
@@ -296,41 +738,311 @@ llvm::Value *IfExpression::codegen() {
     
     // Body block
     BUILDER.SetInsertPoint(bodyblock);
-    llvm::Value *bodyv = body->codegen();
+    llvm::Value *bodyv = codegen_expr(N.B);
     if(!bodyv) return nullptr;
-    BUILDER.CreateBr(mergeblock);
+    bool bodyjumps = BUILDER.GetInsertBlock()->getTerminator(); // Ended in a tail call
+    if (!bodyjumps) {
+        bodyv = convert(bodyv, (*NODES)[N.B].Type, N.Type);
+        BUILDER.CreateBr(mergeblock);
+    }
     bodyblock = BUILDER.GetInsertBlock();
     
     // Else block
     function->getBasicBlockList().push_back(elseblock);
     BUILDER.SetInsertPoint(elseblock);
-    llvm::Value *elsev = xelse->codegen();
+    llvm::Value *elsev = codegen_expr(N.C);
     if (!elsev) return nullptr;
-    BUILDER.CreateBr(mergeblock);
+    bool elsejumps = BUILDER.GetInsertBlock()->getTerminator();
+    if (!elsejumps) {
+        elsev = convert(elsev, (*NODES)[N.C].Type, N.Type);
+        BUILDER.CreateBr(mergeblock);
+    }
     elseblock = BUILDER.GetInsertBlock();
 
+    // Both branches left through tail calls, nothing to merge
+    if (bodyjumps && elsejumps) {
+        delete mergeblock;
+        return elsev;
+    }
+
     // Merge block
     function->getBasicBlockList().push_back(mergeblock);
     BUILDER.SetInsertPoint(mergeblock);
-    llvm::PHINode *PN = BUILDER.CreatePHI(llvm::Type::getDoubleTy(CONTEXT), 2, "IFTMP");
-    PN->addIncoming(bodyv, bodyblock);
-    PN->addIncoming(elsev, elseblock);
+    llvm::PHINode *PN = BUILDER.CreatePHI(llvm_type(N.Type), 2, "IFTMP");
+    if (!bodyjumps) PN->addIncoming(bodyv, bodyblock);
+    if (!elsejumps) PN->addIncoming(elsev, elseblock);
     return PN;
 }
+
+// --- For loops ---
+// for i = start, end[, step] body runs body for i = start, start + step, ...
+// while i < end (i > end for a negative step) and evaluates to the sum of the
+// body's values. The trip count is worked out before the loop, so codegen
+// emits a canonical counted loop: an i64 counter from 0, with the variable
+// recomputed as start + k * step. LLVM can then compute the trip count, hoist,
+// unroll and vectorize it. The interpreter runs the same arithmetic. The
+// variable is an int when start, end and step are, and the sum takes the
+// body's type (bools count).
+
+static const double MAX_TRIPS = 4611686018427387904.0; // 2^62
+
+static int64_t for_trip_count(double Start, double End, double Step) {
+    double Count = ceil((End - Start) / Step);
+    if (!(Count > 0)) return 0; // Also for a zero step or NaN
+    return Count < MAX_TRIPS ? (int64_t)Count : (int64_t)MAX_TRIPS;
+}
+
+static llvm::Value *codegen_for(const ExprNode &N) {
+    auto Parts = NODES->loop(N);
+    ValueType VarType = (ValueType)N.Op;
+    llvm::Type *Double = llvm::Type::getDoubleTy(CONTEXT);
+    llvm::Type *I64 = llvm::Type::getInt64Ty(CONTEXT);
+    llvm::Value *Zero = llvm::ConstantFP::get(CONTEXT, llvm::APFloat(0.0));
+    llvm::Value *SumZero = llvm::Constant::getNullValue(llvm_type(N.Type));
+
+    llvm::Value *Start = codegen_as(Parts[0], VarType);
+    if (!Start) return nullptr;
+    llvm::Value *End = codegen_as(Parts[1], T_DOUBLE);
+    if (!End) return nullptr;
+    llvm::Value *Step = Parts[2] ? codegen_as(Parts[2], VarType)
+                                 : convert(llvm::ConstantInt::get(I64, 1), T_INT, VarType);
+    if (!Step) return nullptr;
+
+    // Trip count, as in for_trip_count
+    llvm::Function *function = BUILDER.GetInsertBlock()->getParent();
+    llvm::Function *Ceil = llvm::Intrinsic::getDeclaration(function->getParent(), llvm::Intrinsic::ceil, {Double});
+    llvm::Value *Span = BUILDER.CreateFSub(End, convert(Start, VarType, T_DOUBLE));
+    llvm::Value *Count = BUILDER.CreateCall(Ceil, {BUILDER.CreateFDiv(Span, convert(Step, VarType, T_DOUBLE))}, "COUNT");
+    Count = BUILDER.CreateSelect(BUILDER.CreateFCmpOGT(Count, Zero), Count, Zero);
+    llvm::Value *Max = llvm::ConstantFP::get(CONTEXT, llvm::APFloat(MAX_TRIPS));
+    Count = BUILDER.CreateSelect(BUILDER.CreateFCmpOLT(Count, Max), Count, Max);
+    llvm::Value *Trips = BUILDER.CreateFPToSI(Count, I64, "TRIPS");
+
+    llvm::BasicBlock *preheader = BUILDER.GetInsertBlock();
+    llvm::BasicBlock *loopblock = llvm::BasicBlock::Create(CONTEXT, "LOOP", function);
+    llvm::BasicBlock *afterblock = llvm::BasicBlock::Create(CONTEXT, "LOOPEND");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSGT(Trips, llvm::ConstantInt::get(I64, 0)), loopblock, afterblock);
+
+    // Loop block
+    BUILDER.SetInsertPoint(loopblock);
+    llvm::PHINode *K = BUILDER.CreatePHI(I64, 2, "K");
+    K->addIncoming(llvm::ConstantInt::get(I64, 0), preheader);
+    llvm::PHINode *Sum = BUILDER.CreatePHI(llvm_type(N.Type), 2, "SUM");
+    Sum->addIncoming(SumZero, preheader);
+
+    llvm::Value *Var = VarType == T_INT
+        ? BUILDER.CreateAdd(Start, BUILDER.CreateMul(K, Step), SYMBOLS.name(N.A))
+        : BUILDER.CreateFAdd(Start, BUILDER.CreateFMul(BUILDER.CreateSIToFP(K, Double), Step), SYMBOLS.name(N.A));
+    llvm::AllocaInst *Slot = create_entry_alloca(function, SYMBOLS.name(N.A), VarType);
+    BUILDER.CreateStore(Var, Slot);
+    llvm::AllocaInst *Shadowed = symbol_slot(NamedValues, N.A);
+    NamedValues[N.A] = Slot;
+    llvm::Value *bodyv = codegen_as(Parts[3], N.Type);
+    NamedValues[N.A] = Shadowed; // Leave scope
+    if (!bodyv) return nullptr;
+
+    llvm::Value *NextSum = N.Type == T_INT ? BUILDER.CreateAdd(Sum, bodyv, "NEXTSUM")
+                                           : BUILDER.CreateFAdd(Sum, bodyv, "NEXTSUM");
+    llvm::Value *NextK = BUILDER.CreateNSWAdd(K, llvm::ConstantInt::get(I64, 1), "NEXTK");
+    BUILDER.CreateCondBr(BUILDER.CreateICmpSLT(NextK, Trips), loopblock, afterblock);
+    llvm::BasicBlock *latch = BUILDER.GetInsertBlock();
+    K->addIncoming(NextK, latch);
+    Sum->addIncoming(NextSum, latch);
+
+    // After the loop
+    function->getBasicBlockList().push_back(afterblock);
+    BUILDER.SetInsertPoint(afterblock);
+    llvm::PHINode *PN = BUILDER.CreatePHI(llvm_type(N.Type), 2, "FORTMP");
+    PN->addIncoming(SumZero, preheader);
+    PN->addIncoming(NextSum, latch);
+    FunctionHasLoops = true;
+    return PN;
+}
+
+static llvm::Value *codegen_expr(ExprRef E) {
+    const ExprNode &N = (*NODES)[E];
+    switch (N.Kind) {
+        case NUM_EXPR:  return codegen_num(N);
+        case VAR_EXPR:  return codegen_var(N);
+        case OP_EXPR:   return codegen_op(N);
+        case CALL_EXPR: return codegen_call(N);
+        case IF_EXPR:   return codegen_if(N);
+        case FOR_EXPR:  return codegen_for(N);
+        case SEQ_EXPR:  return codegen_seq(N);
+        case LET_EXPR:  return codegen_let(N);
+        case ASSIGN_EXPR: return codegen_assign(N);
+        case INDEX_EXPR: return codegen_index(N);
+        case BUILTIN_EXPR: return codegen_builtin(N);
+    }
+    return log_errorv("Unknown expression.");
+}
 // End code gen
 
+// --- Floating point semantics ---
+// Arithmetic is strict IEEE unless -fast-math is given or the definition is
+// written fn fast name(...). A fast function gets every fast-math flag on its
+// arithmetic and comparisons (reassociation, contraction into FMA, no NaNs or
+// infinities, ...), which is what lets reductions be vectorized, and the
+// matching function attributes so the backend relaxes too. The interpreter
+// tier always evaluates strictly.
+
+static thread_local bool FastMath = false;
+
+static void set_fp_semantics(llvm::Function &F, bool Fast) {
+    llvm::FastMathFlags FMF;
+    if (Fast || FastMath) {
+        FMF.setUnsafeAlgebra();
+        for (const char *Attr : {"unsafe-fp-math", "no-nans-fp-math", "no-infs-fp-math", "no-signed-zeros-fp-math"})
+            F.addFnAttr(Attr, "true");
+    }
+    BUILDER.setFastMathFlags(FMF); // Applied by CreateFAdd, CreateFMul, ...
+}
+
+// The builder does not put its flags on comparisons
+static llvm::Value *fp_compare(llvm::Value *Cmp) {
+    if (auto *I = llvm::dyn_cast<llvm::Instruction>(Cmp)) // Constant folded otherwise
+        I->setFastMathFlags(BUILDER.getFastMathFlags());
+    return Cmp;
+}
+
 //			//
 // --- Optimization --- //
 //			//
 
+// Optimization levels, all on the new pass manager:
+//   -O0  only mem2reg, so variable slots still become registers
+//   -O1  SROA, instcombine, reassociate, GVN and simplifycfg on each function as it
+//        is generated (the original fixed pipeline). Functions with a for
+//        loop also get the loop path: rotation, LICM, induction variable
+//        simplification, loop vectorization and unrolling, then the same
+//        cleanup again.
+//   -O2  the default per-module pipeline, run on the whole module right before
+//   -O3  it goes to the JIT: inlining, IPSCCP, global DCE, loop passes and
+//        vectorization. Functions are not optimized one by one at these levels.
+// -time-opt records how long the passes took for each function (or module)
+// and prints the list at exit.
+
+static thread_local unsigned OptLevel = 1;
+static thread_local bool TimeOpt = false;
+
+static void add_cleanup_passes(llvm::FunctionPassManager &FPM) {
+    FPM.addPass(llvm::SROA());            // Variable slots to registers
+    FPM.addPass(llvm::InstCombinePass()); // Instruction combining
+    FPM.addPass(llvm::ReassociatePass()); // Rearrange commutative expressions
+    FPM.addPass(llvm::GVN());
+    FPM.addPass(llvm::SimplifyCFGPass()); // Dead code checking
+    FPM.addPass(llvm::TailCallElimPass()); // Tail calls left by inlining or folding
+}
+
+struct Optimizer {
+    llvm::PassBuilder PB;
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::FunctionPassManager FPM;
+    llvm::FunctionPassManager LoopFPM; // -O1, functions with loops
+    llvm::ModulePassManager MPM;
+    std::vector<std::pair<double, std::string>> Timings; // ms, what was optimized
+
+    Optimizer(llvm::TargetMachine *TM) : PB(TM) {
+        // Registered first, so the builder's default library info is not used
+        llvm::TargetLibraryInfoImpl TLII(TM->getTargetTriple());
+        add_vector_library(TLII, *TM);
+        FAM.registerPass([TLII] { return llvm::TargetLibraryAnalysis(TLII); });
+        MAM.registerPass([TLII] { return llvm::TargetLibraryAnalysis(TLII); });
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+        if (OptLevel == 0) {
+            FPM.addPass(llvm::PromotePass());
+        } else if (OptLevel == 1) {
+            add_cleanup_passes(FPM);
+
+            add_cleanup_passes(LoopFPM);
+            LoopFPM.addPass(llvm::LoopSimplifyPass()); // Preheaders and single latches
+            LoopFPM.addPass(llvm::LCSSAPass());
+            LoopFPM.addPass(llvm::createFunctionToLoopPassAdaptor(llvm::LoopRotatePass()));
+            LoopFPM.addPass(llvm::createFunctionToLoopPassAdaptor(llvm::LICMPass())); // Hoist invariants
+            LoopFPM.addPass(llvm::createFunctionToLoopPassAdaptor(llvm::IndVarSimplifyPass()));
+            LoopFPM.addPass(llvm::LoopVectorizePass());
+            LoopFPM.addPass(llvm::createFunctionToLoopPassAdaptor(llvm::LoopUnrollPass()));
+            add_cleanup_passes(LoopFPM);
+        } else if (OptLevel >= 2) {
+            MPM = PB.buildPerModuleDefaultPipeline(OptLevel == 2 ? llvm::PassBuilder::O2
+                                                                 : llvm::PassBuilder::O3);
+        }
+    }
+};
+
+static uint64_t count_instructions(const llvm::Function &F) {
+    uint64_t N = 0;
+    for (auto &BB : F) N += BB.size();
+    return N;
+}
+
+static void optimize_function(llvm::Function &F) {
+    if (OptLevel >= 2) return;
+    StageScope Timing(STAGE_OPTIMIZE);
+    auto Start = std::chrono::steady_clock::now();
+    Counters.InstsBefore += count_instructions(F);
+    (OptLevel == 1 && FunctionHasLoops ? OPT->LoopFPM : OPT->FPM).run(F, OPT->FAM);
+    Counters.InstsAfter += count_instructions(F);
+    OPT->LAM.clear();
+    OPT->FAM.clear(); // The function may be erased or rewritten before its next run
+    if (TimeOpt)
+        OPT->Timings.push_back(std::make_pair(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count(),
+            F.getName().str()));
+}
+
+static void optimize_module(llvm::Module &M) {
+    if (OptLevel < 2) return;
+    StageScope Timing(STAGE_OPTIMIZE);
+    auto Start = std::chrono::steady_clock::now();
+    for (auto &F : M) Counters.InstsBefore += count_instructions(F);
+    OPT->MPM.run(M, OPT->MAM);
+    for (auto &F : M) Counters.InstsAfter += count_instructions(F);
+    OPT->MAM.clear();
+    OPT->CGAM.clear();
+    OPT->FAM.clear();
+    OPT->LAM.clear();
+    if (TimeOpt) {
+        std::string Names;
+        for (auto &F : M)
+            if (!F.isDeclaration()) Names += (Names.empty() ? "" : ", ") + F.getName().str();
+        OPT->Timings.push_back(std::make_pair(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count(),
+            "module: " + Names));
+    }
+}
+
+static void print_opt_timings() {
+    auto Timings = OPT->Timings;
+    std::sort(Timings.begin(), Timings.end(),
+              [](const std::pair<double, std::string> &A, const std::pair<double, std::string> &B) {
+                  return A.first > B.first;
+              });
+    fprintf(stderr, "optimization time at -O%u:\n", OptLevel);
+    for (auto &T : Timings)
+        fprintf(stderr, "  %10.3f ms  %s\n", T.first, T.second.c_str());
+}
+
 void initialize_module(void) {
 	MODULE = llvm::make_unique<llvm::Module>("JIT", CONTEXT); // Get Module Context
+	ModuleFunctions.assign(SYMBOLS.size(), nullptr); // Nothing declared in the new module yet
 	MODULE->setDataLayout(jit->getTargetMachine().createDataLayout()); // Set data layout for JIT
-	FPM = llvm::make_unique<llvm::legacy::FunctionPassManager>(MODULE.get()); // start FPM
-	FPM->add(llvm::createInstructionCombiningPass()); // Instruction combining
-	FPM->add(llvm::createReassociatePass()); // Rearrange commutative expressions
-	FPM->add(llvm::createGVNPass()); // 
-	FPM->add(llvm::createCFGSimplificationPass()); // Dead code checking
-	FPM->doInitialization();
+	MODULE->setTargetTriple(jit->getTargetMachine().getTargetTriple().str());
+}
+
+// Every module goes through here on its way to the JIT
+static llvm::orc::KaleidoscopeJIT::ModuleHandleT add_module(std::unique_ptr<llvm::Module> M) {
+	multiversion_module(*M);
+	optimize_module(*M);
+	StageScope Timing(STAGE_JIT);
+	return jit->addModule(std::move(M));
 }
 #endif